@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "mm.h"
+#include "alloc.h"
+#include "contig.h"
+#include "stack.h"
+
+/*
+ * Host benchmark of the page allocator (mm.c) and the kmem caches (alloc.c).
+ *
+ * The allocators run unmodified on a simulated RAM: an mmap'ed arena is handed
+ * to memblock exactly like `main()` hands over the physical memory, then
+ * `mm_init` and `kmem_cache_init` run as on the board. Build and run with
+ * `make bench`, or `build/mm_bench [ops] [seed]`.
+ */
+
+#define ARENA_SIZE      (512UL * 1024 * 1024)
+#define ARENA_CMA       (64UL * 1024 * 1024)
+#define DEFAULT_OPS     1000000
+#define TASK_PAGES      2       // Same as `task_alloc()` in sched.c, one page per stack
+#define FRAG_SAMPLES    10      // Rows printed by the fragmentation trace
+#define OBJECT_SIZE     240     // About a `struct tmpfs_node`
+#define APPEND_FILE_SIZE (1UL << 20)  // Size reached by each appended file
+
+extern int bench_quiet;
+
+static unsigned long rng_state = 0x9e3779b97f4a7c15UL;
+
+// xorshift64, the same seed gives the same trace on every host
+static unsigned long rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// All pages back in the buddy free lists, nothing parked in empty slabs, the stack pool or the hot caches
+static unsigned long settled_free_pages() {
+    stack_pool_drain();
+    kmem_shrink_all();
+    pcp_drain_all();
+    return mm_free_pages();
+}
+
+static void report(const char *name, unsigned long ops, unsigned long ns, unsigned long fails, long leaked) {
+    double sec = ns / 1e9;
+    printf("%-26s %10lu ops %8.3f s %10.0f ops/s %8lu fails %6ld pages leaked\n",
+           name, ops, sec, sec > 0 ? ops / sec : 0, fails, leaked);
+}
+
+// Random order, weighted towards small blocks like the kernel's own requests
+static int random_order() {
+    int r = rng() % 100;
+    if (r < 60) return 0;
+    if (r < 75) return 1;
+    if (r < 95) return 2 + rng() % 3;
+    return 5 + rng() % 4;
+}
+
+/**
+ * bench_page_mix - Random `_alloc`/`_free` of blocks of order 0 to 8
+ *
+ * Each op picks a slot of the live set, frees it if it is in use, allocates
+ * it otherwise, so the live set stays around half full.
+ */
+static void bench_page_mix(unsigned long ops) {
+    static void *live[1024];
+    unsigned long base = settled_free_pages();
+    unsigned long fails = mm_stats.alloc_fail_cnt;
+
+    unsigned long start = now_ns();
+    for (unsigned long i = 0; i < ops; i++) {
+        int slot = rng() % 1024;
+        if (live[slot]) {
+            _free(live[slot]);
+            live[slot] = NULL;
+            continue;
+        }
+        live[slot] = _alloc(PAGE_SIZE << random_order());
+        if (live[slot]) *(char*)live[slot] = 1;
+    }
+    unsigned long ns = now_ns() - start;
+
+    for (int i = 0; i < 1024; i++) {
+        if (live[i]) _free(live[i]);
+        live[i] = NULL;
+    }
+    report("page mix", ops, ns, mm_stats.alloc_fail_cnt - fails, base - settled_free_pages());
+}
+
+/**
+ * bench_kmalloc_mix - Random `kmalloc`/`kfree` of 1 to MAX_CHUNK_SIZE bytes
+ */
+static void bench_kmalloc_mix(unsigned long ops) {
+    static void *live[4096];
+    unsigned long base = settled_free_pages();
+    unsigned long fails = 0;
+    for (int i = 0; i < CACHE_NUM; i++) fails += kmem_caches[i].fail_cnt;
+
+    unsigned long start = now_ns();
+    for (unsigned long i = 0; i < ops; i++) {
+        int slot = rng() % 4096;
+        if (live[slot]) {
+            kfree(live[slot]);
+            live[slot] = NULL;
+            continue;
+        }
+        live[slot] = kmalloc(1 + rng() % MAX_CHUNK_SIZE);
+        if (live[slot]) *(char*)live[slot] = 1;
+    }
+    unsigned long ns = now_ns() - start;
+
+    for (int i = 0; i < 4096; i++) {
+        if (live[i]) kfree(live[i]);
+        live[i] = NULL;
+    }
+    for (int i = 0; i < CACHE_NUM; i++) fails -= kmem_caches[i].fail_cnt;
+    report("kmalloc mix", ops, ns, -fails, base - settled_free_pages());
+}
+
+/**
+ * bench_alloc_mix - Random `alloc`/`free` from 16 bytes to 256KB
+ *
+ * Sizes are log-uniform, so both the kmem caches and the page allocator are
+ * exercised through the generic entry points.
+ */
+static void bench_alloc_mix(unsigned long ops) {
+    static void *live[2048];
+    unsigned long base = settled_free_pages();
+    unsigned long fails = mm_stats.alloc_fail_cnt;
+
+    unsigned long start = now_ns();
+    for (unsigned long i = 0; i < ops; i++) {
+        int slot = rng() % 2048;
+        if (live[slot]) {
+            free(live[slot]);
+            live[slot] = NULL;
+            continue;
+        }
+        int shift = 4 + rng() % 15;
+        live[slot] = alloc((1U << shift) + rng() % (1U << shift));
+        if (live[slot]) *(char*)live[slot] = 1;
+    }
+    unsigned long ns = now_ns() - start;
+
+    for (int i = 0; i < 2048; i++) {
+        if (live[i]) free(live[i]);
+        live[i] = NULL;
+    }
+    report("alloc mix", ops, ns, mm_stats.alloc_fail_cnt - fails, base - settled_free_pages());
+}
+
+enum { CHURN_SINGLE, CHURN_BULK, CHURN_POOL };
+
+// Stacks of one task, like `task_alloc_stacks` in sched.c
+static int churn_alloc(int mode, void **pages) {
+    if (mode == CHURN_POOL) return stack_alloc(pages, TASK_PAGES) == 0;
+    if (mode == CHURN_BULK) return _alloc_bulk_class(0, ALLOC_TEMPORARY, TASK_PAGES, pages) == 0;
+
+    int p;
+    for (p = 0; p < TASK_PAGES; p++) {
+        pages[p] = _alloc_class(PAGE_SIZE, ALLOC_TEMPORARY);
+        if (pages[p] == NULL) break;
+    }
+    if (p == TASK_PAGES) return 1;
+    while (p > 0) _free(pages[--p]);
+    return 0;
+}
+
+static void churn_free(int mode, void **pages) {
+    if (mode == CHURN_POOL) {
+        stack_free(pages, TASK_PAGES);
+    }
+    else if (mode == CHURN_BULK) {
+        _free_bulk(pages, TASK_PAGES);
+    }
+    else {
+        for (int p = 0; p < TASK_PAGES; p++) _free(pages[p]);
+    }
+}
+
+/**
+ * bench_fork_churn - Task setup and teardown like fork/exit storms
+ *
+ * Every task takes TASK_PAGES pages (kernel stack, user stack). Bursts of
+ * forks alternate with random exits. One op is one task created or destroyed.
+ *
+ * @param mode: `CHURN_SINGLE` for page by page calls, `CHURN_BULK` for
+ *              `_alloc_bulk_class`/`_free_bulk`, `CHURN_POOL` for the stack pool
+ */
+static void bench_fork_churn(unsigned long ops, int mode) {
+    static const char *names[] = { "fork churn (single)", "fork churn (bulk)", "fork churn (stack pool)" };
+    static void *tasks[256][TASK_PAGES];
+    static int live[256];
+    unsigned long base = settled_free_pages();
+    unsigned long fails = 0;
+
+    unsigned long start = now_ns();
+    unsigned long done = 0;
+    while (done < ops) {
+        int burst = 1 + rng() % 16;
+        int fork = rng() & 1;
+        for (int b = 0; b < burst && done < ops; b++, done++) {
+            int t = rng() % 256;
+            if (live[t] && !fork) {
+                churn_free(mode, tasks[t]);
+                live[t] = 0;
+            }
+            else if (!live[t] && fork) {
+                live[t] = churn_alloc(mode, tasks[t]);
+                if (!live[t]) fails++;
+            }
+        }
+    }
+    unsigned long ns = now_ns() - start;
+
+    for (int t = 0; t < 256; t++) {
+        if (live[t]) churn_free(mode, tasks[t]);
+        live[t] = 0;
+    }
+    report(names[mode], ops, ns, fails, base - settled_free_pages());
+}
+
+/**
+ * bench_objects - Random allocation of fixed size kernel objects
+ *
+ * The same trace runs on a `kmem_cache_create` cache and on `alloc`, which
+ * rounds the objects up to the next kmalloc size class. The pages held by
+ * the live objects are printed before the teardown.
+ *
+ * @param cache: The cache to allocate from, NULL to use `alloc`/`free`
+ */
+static void bench_objects(unsigned long ops, struct kmem_cache *cache) {
+    static void *live[4096];
+    unsigned long base = settled_free_pages();
+    unsigned long fails = 0;
+
+    unsigned long start = now_ns();
+    for (unsigned long i = 0; i < ops; i++) {
+        int slot = rng() % 4096;
+        if (live[slot]) {
+            if (cache) kmem_cache_free(cache, live[slot]);
+            else free(live[slot]);
+            live[slot] = NULL;
+            continue;
+        }
+        live[slot] = cache ? kmem_cache_alloc(cache) : alloc(OBJECT_SIZE);
+        if (live[slot]) *(char*)live[slot] = 1;
+        else fails++;
+    }
+    unsigned long ns = now_ns() - start;
+    unsigned long used = base - settled_free_pages();
+
+    for (int i = 0; i < 4096; i++) {
+        if (live[i] == NULL) continue;
+        if (cache) kmem_cache_free(cache, live[i]);
+        else free(live[i]);
+        live[i] = NULL;
+    }
+    report(cache ? "objects (slab cache)" : "objects (alloc)", ops, ns, fails, base - settled_free_pages());
+    printf("%-26s %10lu pages held by the live objects\n", "", used);
+}
+
+/**
+ * bench_zeroed - Latency of `_alloc_zeroed` with and without the idle pool
+ *
+ * Only the allocations are timed. With `idle` set, `zero_pool_fill` runs
+ * between them like the idle task does between two bursts of work.
+ */
+static void bench_zeroed(unsigned long ops, int idle) {
+    static void *pages[ZERO_FILL_BATCH];
+    unsigned long base = settled_free_pages();
+    unsigned long ns = 0;
+
+    for (unsigned long i = 0; i < ops; i += ZERO_FILL_BATCH) {
+        if (idle) zero_pool_fill(ZERO_FILL_BATCH);
+        unsigned long start = now_ns();
+        for (int k = 0; k < ZERO_FILL_BATCH; k++) pages[k] = _alloc_zeroed(PAGE_SIZE);
+        ns += now_ns() - start;
+        _free_bulk(pages, ZERO_FILL_BATCH);
+    }
+
+    zero_pool_drain();
+    report(idle ? "zeroed page (idle pool)" : "zeroed page (sync)", ops, ns, 0, base - settled_free_pages());
+}
+
+/**
+ * bench_append - Files appended to in `PAGE_SIZE` chunks up to `APPEND_FILE_SIZE`
+ *
+ * The buffer doubles like `tmpfs_write` does, either by moving the data to a
+ * new block or with `krealloc`. One op is one append.
+ */
+static void bench_append(unsigned long ops, int in_place) {
+    static char chunk[PAGE_SIZE];
+    unsigned long base = settled_free_pages();
+    unsigned long grown = mm_stats.grow_cnt;
+    unsigned long fails = 0;
+    unsigned long start = now_ns();
+
+    for (unsigned long i = 0; i < ops;) {
+        char *data = _alloc_class(PAGE_SIZE, ALLOC_TEMPORARY);
+        unsigned long size = 0, capacity = PAGE_SIZE;
+        while (data != NULL && size < APPEND_FILE_SIZE && i < ops) {
+            if (size + PAGE_SIZE > capacity) {
+                char *new_data;
+                if (in_place) {
+                    new_data = krealloc(data, capacity * 2);
+                }
+                else {
+                    new_data = _alloc_class(capacity * 2, ALLOC_TEMPORARY);
+                    if (new_data != NULL) {
+                        memcpy(new_data, data, size);
+                        free(data);
+                    }
+                }
+                if (new_data == NULL) {
+                    fails++;
+                    break;
+                }
+                data = new_data;
+                capacity *= 2;
+            }
+            memcpy(data + size, chunk, PAGE_SIZE);
+            size += PAGE_SIZE;
+            i++;
+        }
+        if (data == NULL) {
+            fails++;
+            i++;
+        }
+        free(data);
+    }
+
+    unsigned long ns = now_ns() - start;
+    report(in_place ? "append (krealloc)" : "append (move)", ops, ns, fails, base - settled_free_pages());
+    printf("%-26s %10lu blocks grown in place\n", "", mm_stats.grow_cnt - grown);
+}
+
+// Can a block of `order` be allocated right now? The block is given back at once
+static int probe(int order) {
+    void *block = _alloc(PAGE_SIZE << order);
+    if (block == NULL) return 0;
+    _free(block);
+    return 1;
+}
+
+/**
+ * bench_frag_trace - Fragmentation over time under mixed lifetimes
+ *
+ * Long-lived unmovable pages (1 op in 16, freed with a small probability) are
+ * interleaved with short-lived temporary blocks, the pattern that scatters
+ * pinned pages over the whole memory. The unusable free space index of a few
+ * orders and whether a 2MB block can still be allocated are sampled over time.
+ */
+static void bench_frag_trace(unsigned long ops) {
+    static void *pinned[16384];
+    static void *temp[2048];
+    int pinned_cnt = 0;
+    unsigned long base = settled_free_pages();
+
+    printf("\n%10s %10s %8s %8s %8s %8s\n", "ops", "free", "frag@4", "frag@9", "frag@11", "2MB ok");
+    for (unsigned long i = 0; i < ops; i++) {
+        if (rng() % 16 == 0 && pinned_cnt < 16384) {
+            pinned[pinned_cnt] = _alloc(PAGE_SIZE);
+            if (pinned[pinned_cnt]) pinned_cnt++;
+        }
+        else if (pinned_cnt && rng() % 64 == 0) {
+            int k = rng() % pinned_cnt;
+            _free(pinned[k]);
+            pinned[k] = pinned[--pinned_cnt];
+        }
+        else {
+            int slot = rng() % 2048;
+            if (temp[slot]) {
+                _free(temp[slot]);
+                temp[slot] = NULL;
+            }
+            else {
+                temp[slot] = _alloc_class(PAGE_SIZE << random_order(), ALLOC_TEMPORARY);
+            }
+        }
+
+        if ((i + 1) % (ops / FRAG_SAMPLES) == 0) {
+            pcp_drain_all();
+            printf("%10lu %10lu %8d %8d %8d %8s\n", i + 1, mm_free_pages(),
+                   mm_frag_index(4), mm_frag_index(PAGEBLOCK_ORDER), mm_frag_index(11),
+                   probe(PAGEBLOCK_ORDER) ? "yes" : "no");
+        }
+    }
+
+    for (int i = 0; i < pinned_cnt; i++) _free(pinned[i]);
+    for (int i = 0; i < 2048; i++) {
+        if (temp[i]) _free(temp[i]);
+        temp[i] = NULL;
+    }
+    printf("pinned at end: %d pages, leaked after teardown: %ld pages\n\n",
+           pinned_cnt, (long)(base - settled_free_pages()));
+}
+
+// Simulated RAM, aligned like the board's memory so that max order blocks are naturally aligned
+static int arena_init() {
+    char *arena = mmap(NULL, ARENA_SIZE + MAX_ALLOC_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) return -1;
+
+    unsigned long base = ((unsigned long)arena + MAX_ALLOC_SIZE - 1) & ~(unsigned long)(MAX_ALLOC_SIZE - 1);
+    memblock_add(base, ARENA_SIZE);
+    contig_init(ARENA_CMA);
+    mm_init();
+    kmem_cache_init();
+    return 0;
+}
+
+static unsigned long parse_ulong(const char *s) {
+    unsigned long n = 0;
+    while (*s >= '0' && *s <= '9') n = n * 10 + (*s++ - '0');
+    return n;
+}
+
+int main(int argc, char **argv) {
+    unsigned long ops = argc > 1 ? parse_ulong(argv[1]) : DEFAULT_OPS;
+    if (argc > 2) rng_state = parse_ulong(argv[2]) | 1;
+    if (ops < FRAG_SAMPLES) ops = FRAG_SAMPLES;
+
+    if (arena_init()) {
+        fprintf(stderr, "mm_bench: cannot map the arena\n");
+        return 1;
+    }
+    bench_quiet = 1;
+    printf("arena: %lu MB, %lu free pages, %lu ops per benchmark\n\n",
+           ARENA_SIZE >> 20, settled_free_pages(), ops);
+
+    bench_page_mix(ops);
+    bench_kmalloc_mix(ops);
+    bench_alloc_mix(ops);
+    bench_fork_churn(ops, CHURN_SINGLE);
+    bench_fork_churn(ops, CHURN_BULK);
+    bench_fork_churn(ops, CHURN_POOL);
+    bench_objects(ops, kmem_cache_create("bench", OBJECT_SIZE, 0, NULL));
+    bench_objects(ops, NULL);
+    bench_zeroed(ops, 0);
+    bench_zeroed(ops, 1);
+    bench_append(ops, 0);
+    bench_append(ops, 1);
+    bench_frag_trace(ops);
+
+    printf("splits %lu, merges %lu, hot cache hits %lu, failures %lu\n",
+           mm_stats.split_cnt, mm_stats.merge_cnt, mm_stats.pcp_hit_cnt, mm_stats.alloc_fail_cnt);
+    return 0;
+}
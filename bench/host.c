@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <time.h>
+#include "uart.h"
+
+/*
+ * Stand-ins for what the allocators take from the rest of the kernel when they
+ * are built for the host: the UART, the counter timer used by the allocation
+ * profile and the linker symbols bounding the startup heap. The startup heap
+ * is empty here, everything comes from the arena.
+ */
+
+char *__bss_end;
+char *__stack_top;
+
+int bench_quiet = 0;  // Set once the arena is up, allocation failures are counted instead of printed
+
+void uart_puts(char *s) {
+    if (!bench_quiet) fputs(s, stderr);
+}
+
+void uart_hex(unsigned int d) {
+    if (!bench_quiet) fprintf(stderr, "%x", d);
+}
+
+// Nanoseconds stand in for the ticks of the counter timer
+unsigned long long get_tick() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long get_freq() {
+    return 1000000000ULL;
+}
@@ -4,27 +4,90 @@
 #include <stddef.h>
 #include "mm.h"
 #include "uart.h"
+#include "smp.h"
 
-struct kmem_cache_entry {
-    struct kmem_cache_entry *prev;
-    struct kmem_cache_entry *next;
+#define MAX_CHUNK_SIZE  2048
+#define MIN_CHUNK_SIZE  8
+#define CACHE_NUM       15  // kmalloc size classes, see `kmalloc_sizes`. The class index fits in `PAGE_ORDER_MASK`
+#define CLASS_SHIFT     3   // Granularity of the size to class lookup table
+#define MAX_SLAB_CACHES 16  // Caches created by `kmem_cache_create`
+#define MAX_SLAB_ORDER  3   // Slabs are up to 8 pages, the position of a page in its slab fits in `PAGE_ORDER_MASK`
+#define SLAB_EMPTY_HIGH 2   // Empty slabs a cache keeps before releasing some, absorbs alloc/free bursts
+#define SLAB_EMPTY_LOW  1   // Empty slabs left after a release
+#define MAG_SIZE        14  // Objects per magazine, a magazine fills two cache lines
+#define MAG_REFILL      7   // Objects moved from the slabs to an empty magazine at once
+#define DEPOT_FULL_HIGH 4   // Full magazines kept by a depot, the objects of extra ones go back to their slabs
+
+// A stack of free objects, moved whole between a core and the depot of its cache
+struct kmem_magazine {
+    struct kmem_magazine *next;     // In a depot list
+    int count;
+    void *objs[MAG_SIZE];
 };
+
+// Core-local layer of a cache, only its own core touches it, with IRQs masked
+struct kmem_cpu_cache {
+    struct kmem_magazine *loaded;   // Objects are taken from and put in this magazine
+    struct kmem_magazine *prev;     // Full or empty, swapped with `loaded` before going to the depot
+    unsigned long alloc_cnt;
+    unsigned long free_cnt;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
 struct kmem_cache {
-    int cache_size;   // The size of each chunk in this cache
-    struct kmem_cache_entry *free_list;
+    int cache_size;   // The size of each object in this cache, alignment included
+    const char *name;
+    int obj_offset;             // Offset of the first object in a slab, after the header
+    int slab_order;             // Pages per slab, as a buddy order
+    int objs_per_slab;
+    void (*ctor)(void *obj);    // Run on every allocated object, can be NULL
+    struct slab *partial;       // Slabs with free and allocated objects
+    struct slab *full;
+    struct slab *empty;         // Slabs without allocated objects, kept for reuse up to `SLAB_EMPTY_HIGH`
+    int empty_cnt;
+
+    // Magazine layer, see `kmem_cache_alloc`
+    int use_magazines;          // 0 for the cache of the magazines themselves
+    struct spinlock lock;       // Protects the depot and the slabs
+    struct kmem_magazine *depot_full;
+    struct kmem_magazine *depot_empty;
+    int depot_full_cnt;
+
+    // Statistics, reported by `meminfo`
+    int pages;                  // Pages carved into chunks
+    int in_use;                 // Chunks out of the slabs, in magazines or handed out
+    unsigned long fail_cnt;
+
+    struct kmem_cpu_cache cpu[NR_CPUS];  // Allocation and free counts are per core, see `kmem_cache_counts`
+};
+
+// Header at the start of each slab, the objects follow it
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *prev;
+    struct slab *next;
+    void *free_list;    // Free objects, linked through their first word
+    int in_use;         // Objects handed out
 };
 
+extern struct kmem_cache kmem_caches[CACHE_NUM];
+extern struct kmem_cache kmem_slab_caches[MAX_SLAB_CACHES];
+extern int kmem_slab_cache_num;
+
 void* simple_alloc(unsigned int size);
-void kmem_freelist_push(struct kmem_cache_entry *entry, struct kmem_cache *cache);
-void kmem_freelist_pop(struct kmem_cache *cache);
 void print_kmem_freelist();
 void kmem_cache_init();
-void request_page(unsigned int order);
-unsigned int get_chunk_order(unsigned int size);
+int get_chunk_class(unsigned int size);
 void* kmalloc(unsigned int size);
 void kfree(void *ptr);
+struct kmem_cache* kmem_cache_create(const char *name, unsigned int size, unsigned int align, void (*ctor)(void *obj));
+void* kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *ptr);
+int kmem_cache_shrink(struct kmem_cache *cache);
+void kmem_cache_counts(struct kmem_cache *cache, unsigned long *alloc_cnt, unsigned long *free_cnt);
+int kmem_shrink_all();
 void* alloc(unsigned int size);
 void free(void *ptr);
+void* krealloc(void *ptr, unsigned int new_size);
 
 void test_alloc();
 
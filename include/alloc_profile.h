@@ -0,0 +1,22 @@
+#ifndef ALLOC_PROFILE_H
+#define ALLOC_PROFILE_H
+
+// Build with -DALLOC_PROFILE to record live bytes, allocation rate and peak per call site
+#define ALLOC_PROFILE_SITES 128     // Call sites tracked, allocations from further sites are not recorded
+#define ALLOC_PROFILE_OBJS  4096    // Live allocations tracked, a power of two
+
+#define ALLOC_PROFILE_BY_BYTES  0   // Sort the dump by live bytes
+#define ALLOC_PROFILE_BY_RATE   1   // Sort the dump by allocations per second
+
+#ifdef ALLOC_PROFILE
+void alloc_profile_add(void *ptr, unsigned int size, void *site);
+void alloc_profile_del(void *ptr);
+#else
+static inline void alloc_profile_add(void *ptr, unsigned int size, void *site) {}
+static inline void alloc_profile_del(void *ptr) {}
+#endif
+
+void alloc_profile_reset();
+void print_alloc_profile(int sort_by);
+
+#endif /* ALLOC_PROFILE_H */
@@ -0,0 +1,17 @@
+#ifndef CONTIG_H
+#define CONTIG_H
+
+#include "mm.h"
+
+#define CONTIG_DEFAULT_SIZE (64 * 1024 * 1024)  // Used when the bootargs have no `cma=`
+#define CONTIG_ALIGN        (2 * 1024 * 1024)   // Alignment of the region itself
+
+unsigned long contig_parse_size(const char *bootargs);
+int contig_init(unsigned long size);
+int contig_contains(void *ptr);
+void* alloc_contig(unsigned long size, unsigned long align);
+void free_contig(void *ptr);
+unsigned long contig_size(void *ptr);
+void contig_usage(int *total_pages, int *used_pages);
+
+#endif /* CONTIG_H */
@@ -31,12 +31,26 @@ struct fdt_prop {
     uint32_t nameoff;
 };
 
+// An entry of the memory reservation block
+struct fdt_reserve_entry {
+    uint64_t address;
+    uint64_t size;
+};
+
 typedef int (*fdt_callback)(int type, const char* name, const void* data, uint32_t size, void* user_data);
+typedef void (*fdt_rsvmap_callback)(uint64_t address, uint64_t size);
+
+extern uint64_t fdt_memory_base;
+extern uint64_t fdt_memory_size;
+extern const char* fdt_bootargs;
 
 int fdt_init(const void* fdt_base);
 int fdt_parse_node(const void** ptr, fdt_callback callback);
 int fdt_traverse(fdt_callback callback);
+int fdt_traverse_rsvmap(fdt_rsvmap_callback callback);
 void fdt_print_header(const struct fdt_header* header);
 int initramfs_callback(int type, const char* name, const void* data, uint32_t size, void* user_data);
+int bootargs_callback(int type, const char* name, const void* data, uint32_t size, void* user_data);
+int memory_callback(int type, const char* name, const void* data, uint32_t size, void* user_data);
 
 #endif /* DEVICETREE_H */
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "uart.h"
 #include "timer.h"
 #include "syscall.h"
+#include "smp.h"
 
 #define IRQ_BASE            0x3f00b000
 
@@ -18,8 +19,12 @@
 #define DISABLE_IRQS_2      ((volatile unsigned int*)(IRQ_BASE + 0x220))
 #define DISABLE_BASIC_IRQS  ((volatile unsigned int*)(IRQ_BASE + 0x224))
 
-#define CORE0_IRQ_SOURCE    ((volatile unsigned int *)0x40000060)
+#define CORE_IRQ_SOURCE(cpu)    ((volatile unsigned int *)(0x40000060 + 4 * (cpu)))
+#define CORE_MBOX_IRQ_CTRL(cpu) ((volatile unsigned int *)(0x40000050 + 4 * (cpu)))
+#define CORE_MBOX0_SET(cpu)     ((volatile unsigned int *)(0x40000080 + 16 * (cpu)))  // Write 1s to set bits
+#define CORE_MBOX0_CLR(cpu)     ((volatile unsigned int *)(0x400000c0 + 16 * (cpu)))  // Write 1s to clear bits
 #define TIMER_IRQ           (1 << 1)
+#define MBOX0_IRQ           (1 << 4)  // Mailbox 0 of the core, the wake-ups other cores send
 #define GPU_IRQ             (1 << 8)  // mini UART IRQ bit
 
 struct TrapFrame {
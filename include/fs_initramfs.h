@@ -19,7 +19,8 @@ struct initramfs_node {
     struct initramfs_node* parent; // Pointer to parent directory node
 
     // For files
-    char* data;      // File content
+    char* data;      // File content, a copy or `image`
+    char* image;     // File content in the cpio archive
     size_t size;     // Current size of the file content
     size_t capacity; // Allocated buffer capacity for data
 
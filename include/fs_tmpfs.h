@@ -10,6 +10,7 @@
 #define MAX_FILE_NAME 64
 #define MAX_CHILDREN 16
 #define DEFAULT_FILE_SIZE 4096 
+#define MAX_TMPFS_MOUNTS 8  // Mounts whose files the shrinker trims
 
 // Enum to distinguish between file and directory
 typedef enum {
@@ -7,6 +7,7 @@
 #include "fs_initramfs.h"
 #include "dev_uart.h"
 #include "dev_framebuffer.h"
+#include "meminfo.h"
 
 // Placeholder for O_CREAT flag, typically from <fcntl.h>
 #define O_CREAT 00000100  // Example value, ensure it matches your system\'s O_CREAT
@@ -81,6 +82,8 @@ struct vnode_operations {
 };
 
 extern struct mount* rootfs;
+extern struct kmem_cache* vnode_cache;
+extern struct kmem_cache* file_cache;
 
 int register_filesystem(struct filesystem* fs);
 
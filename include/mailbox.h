@@ -27,5 +27,6 @@
 #define MBOX_CH_PROP        8
 
 unsigned int mailbox_call(volatile unsigned int *mbox, unsigned char channel);
+unsigned int mailbox_get_arm_memory(unsigned int *base, unsigned int *size);
 
 #endif /* MAILBOX_H */
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef MEMBLOCK_H
+#define MEMBLOCK_H
+
+#define MEMBLOCK_MAX_REGIONS    32
+
+// A physical address range [start, end)
+struct MemRegion {
+    unsigned long start;
+    unsigned long end;
+};
+
+// Sorted, non-overlapping list of regions
+struct MemBlockType {
+    int cnt;
+    struct MemRegion regions[MEMBLOCK_MAX_REGIONS];
+};
+
+int memblock_add(unsigned long base, unsigned long size);
+int memblock_reserve(unsigned long base, unsigned long size);
+int memblock_next_free(unsigned long *cursor, struct MemRegion *out);
+void* memblock_alloc(unsigned long size, unsigned long align);
+unsigned long memblock_start();
+unsigned long memblock_end();
+void memblock_dump();
+
+#endif /* MEMBLOCK_H */
@@ -0,0 +1,24 @@
+#ifndef MEMINFO_H
+#define MEMINFO_H
+
+#include "fs_vfs.h"
+#include "alloc.h"
+#include "mm.h"
+#include "stack.h"
+#include "uart.h"
+#include <stddef.h>
+
+#define MEMINFO_BUF_SIZE    4096
+
+extern struct file_operations meminfo_f_ops;
+
+int meminfo_report(char *buf, int size);
+void print_meminfo();
+
+int meminfo_open(struct vnode* file_node, struct file** target);
+int meminfo_close(struct file* file);
+int meminfo_write(struct file* file, const void* buf, size_t len);
+int meminfo_read(struct file* file, void* buf, size_t len);
+long meminfo_lseek64(struct file* file, long offset, int whence);
+
+#endif /* MEMINFO_H */
@@ -1,37 +1,120 @@
 #ifndef MM_H
 #define MM_H
 
+#include <stdint.h>
 #include "uart.h"
 #include "alloc.h"
 #include "utils.h"
+#include "memblock.h"
 
 #define MAX_ORDER       14
 #define PAGE_SIZE       4096
-#define MEMORY_SIZE     0x3C000000  // Unit: byte
-#define PAGE_NUM        (MEMORY_SIZE / PAGE_SIZE)
 #define MAX_BLOCK_SIZE  (1 << (MAX_ORDER - 1))  // Max number of pages in a block
 #define MAX_ALLOC_SIZE  (PAGE_SIZE * MAX_BLOCK_SIZE)  // Max size of a block
+#define PAGE_ALIGN(addr)    (((unsigned long)(addr) + PAGE_SIZE - 1) & ~(unsigned long)(PAGE_SIZE - 1))
 
-// The entry of the free list
-// struct Block {
-//     int idx;            // Index in the frame array
-//     struct Block *prev;
-//     struct Block *next;
-// };
-
-struct PageInfo {
-    int idx;
-    int order;  // Use for `mm`, represent the order of the page
-    int cache_order;  // Use for `kmem`, represent the order of the cache. -1 if not in cache
-    struct PageInfo *entry_in_list; // Pointer to the entry in the free list
-    struct PageInfo *prev;  // Pointer to the previous page in the free list
-    struct PageInfo *next;  // Pointer to the next page in the free list
+// Per-page metadata byte
+#define PAGE_ORDER_MASK 0x0F  // Order of an allocated block (head page), or the position of a slab page in its slab
+#define PAGE_ALLOCATED  0x10  // Head page of a block handed out by `_alloc`
+#define PAGE_PCP        0x40  // Head page of a block held by a hot page cache
+#define PAGE_SLAB       0x80  // Page of a slab cache, the header at the start of the slab points to the cache
+#define PAGE_CLASS_MASK 0x03  // Head page of a free block: class of the free list it is on
+
+// Allocation lifetime classes. Each pageblock belongs to one class and its
+// free blocks are kept in the free lists of that class, so that long-lived
+// and short-lived allocations do not share high-order blocks.
+#define ALLOC_UNMOVABLE     0   // Kernel objects freed at an unknown time (vnodes, mounts, timers...)
+#define ALLOC_RECLAIMABLE   1   // Pages that can be given back under pressure (kmem cache pages)
+#define ALLOC_TEMPORARY     2   // Short-lived buffers (task stacks, tmpfs data)
+#define ALLOC_CLASSES       3
+
+#define PAGEBLOCK_ORDER     9   // 2MB pageblocks
+#define PAGEBLOCK_PAGES     (1 << PAGEBLOCK_ORDER)
+
+// Hot page caches of recently freed blocks, in front of the buddy free lists
+#define PCP_ORDERS      2   // Orders 0 and 1 are cached
+#ifndef PCP_HIGH
+#define PCP_HIGH        32  // Default high watermark, blocks above it are drained back
+#endif
+#ifndef PCP_BATCH
+#define PCP_BATCH       8   // Blocks moved per refill or drain
+#endif
+
+#define MAX_BULK        32  // Blocks per `_alloc_bulk` call
+
+// Callbacks releasing cached memory under pressure, see `register_shrinker`
+#define MAX_SHRINKERS   8
+
+// Free page watermarks, as a fraction of the managed pages
+#define WMARK_LOW_DIV       64  // Below 1/64 free, the idle task runs the shrinkers
+#define WMARK_CRITICAL_DIV  256 // Below 1/256 free, memory is about to run out
+#define WMARK_OK        0
+#define WMARK_LOW       1
+#define WMARK_CRITICAL  2
+
+// Pool of free pages zeroed ahead of time by the idle task, see `_alloc_zeroed`
+#ifndef ZERO_POOL_HIGH
+#define ZERO_POOL_HIGH  64  // Pages kept zeroed
+#endif
+#define ZERO_FILL_BATCH 4   // Pages zeroed per pass of the idle loop
+
+// Words needed by the per-order free bitmaps, order `o` has (pages >> o) + 1 bits at most
+#define FREE_MAP_WORDS(pages)   (((pages) / 64) * 2 + MAX_ORDER)
+
+// The entry of the free list, stored in the first bytes of the free block itself
+struct FreeBlock {
+    struct FreeBlock *prev;
+    struct FreeBlock *next;
 };
 
+// LIFO of blocks of one order: allocations pop the hottest block at `head`, drains take the coldest at `tail`
+struct PageCache {
+    struct FreeBlock *head;
+    struct FreeBlock *tail;
+    int count;
+    int high;   // Drain when `count` goes above it
+    int batch;  // Blocks moved per refill or drain
+};
+
+struct Shrinker {
+    const char *name;           // Shown by `meminfo`
+    int (*shrink)(void);        // Releases what it can, returns the number of pages given back
+    unsigned long call_cnt;
+    unsigned long freed_pages;
+};
+
+// Always-on counters of the page allocator, reported by `meminfo`
+struct MemStats {
+    unsigned long free_blocks[MAX_ORDER];   // Blocks currently in the free lists
+    unsigned long alloc_cnt[MAX_ORDER];     // Successful allocations per order
+    unsigned long free_cnt[MAX_ORDER];      // Frees per order
+    unsigned long alloc_fail_cnt;           // Allocations that found no memory
+    unsigned long split_cnt;                // Blocks split in two
+    unsigned long merge_cnt;                // Blocks merged with their buddy
+    unsigned long pcp_hit_cnt;              // Allocations served by a hot page cache
+    unsigned long zero_hit_cnt;             // `_alloc_zeroed` served by the zeroed pool
+    unsigned long zero_miss_cnt;            // `_alloc_zeroed` that had to clear the memory itself
+    unsigned long pressure_cnt;             // Allocations that had to release cached memory first
+    unsigned long grow_cnt;                 // Blocks grown in place by `krealloc`
+    unsigned long wmark_low_cnt;            // Times the free pages were seen falling below the low watermark
+    unsigned long wmark_critical_cnt;       // Times the free pages were seen falling below the critical watermark
+    unsigned long reclaim_cnt;              // Shrinker runs started by the idle task, ahead of any failure
+    unsigned long fallback_cnt[ALLOC_CLASSES];          // Blocks taken from the free lists of another class
+    unsigned long pageblock_claim_cnt[ALLOC_CLASSES];   // Pageblocks converted to the class by a fallback
+};
+
+extern void *memory_start;
+extern int page_num;
+extern struct MemStats mm_stats;
+
 // Utility functions
 int round(int size);
 int get_order(int size);
 int get_buddy(int idx, int order);
+void set_page_slab(int idx, int pos);
+int page_is_slab(int idx);
+int get_slab_page_pos(int idx);
+void clear_page_slab(int idx, int order);
 
 // Printing functions
 void print_add_msg(int idx, int order);
@@ -41,10 +124,40 @@ void print_free_page_msg(void* addr, int idx, int curr_idx, int order);
 void print_free_list();
 
 // Memory management functions
-void add_to_free_list(struct PageInfo *entry, int order);
+void add_to_free_list(int idx, int order);
 void mm_init();
 void* _alloc(unsigned int size);
+void* _alloc_class(unsigned int size, int alloc_class);
 void _free(void *ptr);
+int _resize_in_place(void *ptr, unsigned int size);
+unsigned long _block_size(void *ptr);
+int block_alloc_class(void *ptr);
+int _alloc_bulk(int order, int count, void **out);
+int _alloc_bulk_class(int order, int alloc_class, int count, void **out);
+void _free_bulk(void **ptrs, int count);
 void reserve(void *start, void *end);
+int pcp_set_high(int order, int high);
+void pcp_drain_all();
+int register_shrinker(const char *name, int (*shrink)(void));
+int shrink_all();
+int mm_watermark();
+void mm_reclaim();
+void* _alloc_zeroed(unsigned int size);
+int zero_pool_fill(int budget);
+void zero_pool_drain();
+void print_alloc_class_stats();
+
+// Statistics
+unsigned long mm_free_pages();
+int mm_frag_index(int order);
+int pcp_cached_pages();
+int zero_pool_pages();
+int pageblock_count(int alloc_class);
+const char* alloc_class_name(int alloc_class);
+unsigned long mm_available_pages();
+unsigned long wmark_pages(int level);
+const char* wmark_name(int level);
+int shrinker_count();
+const struct Shrinker* shrinker_get(int i);
 
-#endif
\ No newline at end of file
+#endif
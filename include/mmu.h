@@ -0,0 +1,70 @@
+#ifndef MMU_H
+#define MMU_H
+
+#include <stdint.h>
+
+/*
+ * From ARMv8-A Reference Manual:
+ *     TCR_EL1, Translation Control Register: D13.2.120
+ *     MAIR_EL1, Memory Attribute Indirection Register: D13.2.97
+ *     SCTLR_EL1, System Control Register: D13.2.118
+ *     VMSAv8-64 descriptor formats: D5.3
+ */
+
+#define PT_ENTRIES          512         // Entries per translation table (4KB granule)
+#define PT_SIZE             4096        // Size of a translation table
+#define L1_BLOCK_SIZE       0x40000000  // 1GB
+#define L2_BLOCK_SIZE       0x200000    // 2MB
+#define L3_PAGE_SIZE        0x1000      // 4KB
+
+/* Physical memory layout of bcm2710 */
+#define PERIPHERAL_BASE     0x3F000000  // Peripherals, up to 0x40000000
+#define LOCAL_PERIPHERAL_BASE 0x40000000  // ARM local peripherals (core timers, mailboxes)
+
+/* Descriptor bits */
+#define PD_TABLE            0b11
+#define PD_BLOCK            0b01
+#define PD_PAGE             0b11
+#define PD_ATTR_INDX(idx)   ((idx) << 2)
+#define PD_AP_RW_EL0        (0b01 << 6)  // RW at EL1 and EL0
+#define PD_AP_RO_EL0        (0b11 << 6)  // RO at EL1 and EL0
+#define PD_INNER_SHAREABLE  (0b11 << 8)
+#define PD_ACCESS           (1 << 10)
+#define PD_PXN              (1UL << 53)  // Privileged execute-never
+#define PD_UXN              (1UL << 54)  // Unprivileged execute-never
+
+/* Memory attributes */
+#define MAIR_DEVICE_nGnRE   0x04
+#define MAIR_NORMAL_WBWA    0xFF        // Inner/outer write-back, read/write-allocate
+#define MAIR_IDX_DEVICE     0
+#define MAIR_IDX_NORMAL     1
+#define MAIR_VALUE          ((MAIR_DEVICE_nGnRE << (MAIR_IDX_DEVICE * 8)) | \
+                             (MAIR_NORMAL_WBWA << (MAIR_IDX_NORMAL * 8)))
+
+/* Translation control: 32-bit VA through TTBR0 only, 4KB granule, walks are cacheable */
+#define TCR_T0SZ            (64 - 32)
+#define TCR_IRGN0_WBWA      (0b01 << 8)
+#define TCR_ORGN0_WBWA      (0b01 << 10)
+#define TCR_SH0_INNER       (0b11 << 12)
+#define TCR_TG0_4K          (0b00 << 14)
+#define TCR_EPD1            (1 << 23)   // No walks through TTBR1
+#define TCR_VALUE           (TCR_T0SZ | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | \
+                             TCR_SH0_INNER | TCR_TG0_4K | TCR_EPD1)
+
+#define SCTLR_M             (1 << 0)    // MMU enable
+#define SCTLR_C             (1 << 2)    // Data cache enable
+#define SCTLR_I             (1 << 12)   // Instruction cache enable
+#define SCTLR_UCT           (1 << 15)   // EL0 access to CTR_EL0
+#define SCTLR_UCI           (1 << 26)   // EL0 cache maintenance (the shell calls mailbox_call at EL0)
+
+/* Descriptors used by the identity map */
+#define PD_NORMAL           (PD_ACCESS | PD_INNER_SHAREABLE | PD_ATTR_INDX(MAIR_IDX_NORMAL))
+#define PD_DEVICE           (PD_ACCESS | PD_ATTR_INDX(MAIR_IDX_DEVICE) | PD_AP_RW_EL0 | PD_PXN | PD_UXN)
+#define PD_KERNEL_TEXT      (PD_NORMAL | PD_AP_RO_EL0)
+#define PD_KERNEL_DATA      (PD_NORMAL | PD_AP_RW_EL0 | PD_PXN)
+
+void mmu_init();
+void mmu_enable();
+void dcache_clean_invalidate_range(void *start, unsigned long size);
+
+#endif /* MMU_H */
@@ -0,0 +1,18 @@
+#ifndef PID_H
+#define PID_H
+
+/*
+ * Registry of the live tasks, keyed by pid. A task is registered from its
+ * creation until it is reaped, whatever queue it is in or if it is running.
+ */
+
+#define PID_MAX         4096    // Pids go from 0 to PID_MAX - 1, a multiple of 64
+#define PID_HASH_SIZE   64      // Buckets of the pid table, a power of two
+
+struct ThreadTask;
+
+int task_register(struct ThreadTask *task);
+void task_unregister(struct ThreadTask *task);
+struct ThreadTask* task_lookup(int pid);
+
+#endif /* PID_H */
@@ -8,10 +8,19 @@
 #include "signal.h"
 #include "exception.h"
 #include "fs_vfs.h"
+#include "stack.h"
+#include "pid.h"
+#include "smp.h"
 
 #define MAX_TASKS 64
+#define NR_PRIO 32  // Priority levels, 0 is the most urgent, one bit each in `prio_array.bitmap`
 #define DEFAULT_PRIORITY 10
-#define THREAD_STACK_SIZE 0x1000  // 4KB stack size
+#define IDLE_PRIORITY (NR_PRIO - 1)  // Tasks at this level, the idle tasks, never move to another core
+// Scheduler ticks a task runs before the others of its level, the urgent levels get longer slices
+#define PRIO_TIMESLICE(prio) (1 + (NR_PRIO - 1 - (prio)) / 8)
+#define CPU_MASK_ALL ((1U << NR_CPUS) - 1)  // The default affinity of a task
+#define BALANCE_INTERVAL 16  // Scheduler ticks of core 0 between two balancing passes
+#define TASK_PAGES 2  // Kernel stack and user stack, one page each. The task and its signal frame come from slab caches
 #define TASK_READY 0
 #define TASK_RUNNING 1
 #define TASK_BLOCKED 2
@@ -36,11 +45,14 @@ struct cpu_context {
 
 struct ThreadTask {
     struct cpu_context cpu_context;
+    volatile int on_cpu;  // Its registers are live on a core, `cpu_switch_to` clears it once they are saved
     unsigned int id; // Thread ID
     long state;
     long counter;
     long priority;
     long preempt_count;  // Whether this task can be preempted currently, non-zero means cannot.
+    int cpu;             // Core whose run queue holds the task, the creating core
+    unsigned int cpus_allowed;  // Bit per core the task may be moved to, see `sched_set_affinity`
     void* kernel_stack;
     void* user_stack;
 
@@ -55,8 +67,46 @@ struct ThreadTask {
     
     // Linked list pointers
     struct ThreadTask *next;
+    struct ThreadTask *pid_next;  // Next task of the same bucket of the pid table
 };
 
+// FIFO run queue per priority level, and a bitmap of the levels that have tasks
+struct prio_array {
+    unsigned int bitmap;  // Bit (31 - level) set if the level has tasks, so `clz` gives the most urgent one
+    int nr_tasks;
+    int nr_movable[NR_CPUS];  // Tasks, the idle tasks aside, whose affinity allows each core, read unlocked by thieves
+    struct ThreadTask *head[NR_PRIO];
+    struct ThreadTask *tail[NR_PRIO];
+};
+
+/*
+ * Ready tasks, in two arrays. Tasks run from `active` and move to `expired`
+ * when their time slice is used up; when `active` is empty the arrays swap.
+ * Every ready task thus runs once per round, the urgent levels first and for
+ * longer, and the idle task cannot starve behind a busy loop.
+ *
+ * Each core has its own run queue, with the tasks it blocked and the tasks
+ * that exited on it. Other cores only take `lock` to queue, kill or
+ * reprioritize a task of this core; exited tasks are reaped by the idle task
+ * of the core, once their stack is no longer in use.
+ */
+struct run_queue {
+    struct spinlock lock;
+    struct prio_array arrays[2];
+    struct prio_array *active;
+    struct prio_array *expired;
+    struct ThreadTask *blocked;
+    struct ThreadTask *zombies;
+    int busy;                // The running task is not an idle task
+    volatile int sleeping;   // The idle task is in `wfi` or about to, other cores queuing work wake it up
+    unsigned long sleep_cnt; // Times the idle task slept with the tick stopped
+
+    // Migrations, see `sched_steal` and `sched_balance`
+    unsigned long steal_cnt;        // Tasks this core took from the busiest core while idle
+    unsigned long balance_in_cnt;   // Tasks the balancing pass moved to this core
+    unsigned long migrate_out_cnt;  // Tasks that left this core, stolen or balanced
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
 #ifndef __ASSEMBLER__
 extern struct ThreadTask* get_current(void);
 extern void set_current(struct ThreadTask *task);
@@ -64,14 +114,22 @@ extern void cpu_switch_to(struct ThreadTask *prev, struct ThreadTask *next);
 extern void ret_from_fork(void);
 #endif
 
-extern struct ThreadTask *ready_queue;
-extern struct ThreadTask *wait_queue;
-extern struct ThreadTask *zombie_queue;
-extern unsigned int thread_cnt;
+extern struct run_queue run_queues[NR_CPUS];
+extern unsigned int thread_cnt;  // Live tasks, registered in the pid table
 
 void sched_init();
+int sched_init_secondary();
+struct ThreadTask* task_alloc(int zero_stack);
 struct ThreadTask* thread_create(void (*callback)(void));
 struct ThreadTask* get_thread_task_by_id(int pid);
+void sched_enqueue(struct ThreadTask *task);
+int sched_dequeue(struct ThreadTask *task);
+int sched_set_priority(unsigned int pid, int priority);
+int sched_set_affinity(unsigned int pid, unsigned int mask);
+int sched_tick();
+int sched_steal();
+void sched_balance();
+void print_sched_stats();
 void _exit();
 int _kill(unsigned int pid);
 void schedule();
@@ -11,6 +11,8 @@
 #include "exec.h"
 #include "syscall.h"
 #include "mm.h"
+#include "meminfo.h"
+#include "alloc_profile.h"
 #include <stddef.h>
 
 #define MAX_CMD_LENGTH 64
@@ -11,6 +11,7 @@ typedef void (*sighandler_t)(int);
 #include "syscall.h"
 #include "exception.h"
 
+void signal_raise(struct ThreadTask *task, int sig);
 void check_pending_signals(struct ThreadTask *task, struct TrapFrame *trapframe);
 void handle_signal(struct ThreadTask *task, int sig, struct TrapFrame *trapframe);
 
@@ -0,0 +1,127 @@
+#ifndef SMP_H
+#define SMP_H
+
+/*
+ * Multi-core primitives: core id, spinlocks, IRQ masking and the bring-up of
+ * the secondary cores, see `smp.c`.
+ *
+ * The host build of the allocators (`make bench`) is single threaded, it gets
+ * plain C stand-ins where the kernel uses AArch64 instructions.
+ */
+
+#define NR_CPUS         4   // Cortex-A53 cores of the BCM2837
+#define CACHE_LINE_SIZE 64
+
+// The firmware parks core N polling the 64-bit release address at SPIN_TABLE_BASE + 8 * N
+#define SPIN_TABLE_BASE         0xd8
+#define SECONDARY_STACK_SIZE    0x4000  // Boot stack of cores 1-3, then the stack of their idle task
+
+#ifndef __ASSEMBLER__
+struct spinlock {
+    volatile unsigned int locked;
+};
+
+// Index of the running core, from the affinity level 0 of MPIDR_EL1
+static inline int cpu_id() {
+#ifdef __aarch64__
+    unsigned long mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return mpidr & 0xFF;
+#else
+    return 0;
+#endif
+}
+
+// Mask IRQs and return the previous mask, for `irq_restore`
+static inline unsigned long irq_save() {
+#ifdef __aarch64__
+    unsigned long flags;
+    asm volatile("mrs %0, daif\n"
+                 "msr daifset, #2\n" : "=r"(flags) : : "memory");
+    return flags;
+#else
+    return 0;
+#endif
+}
+
+static inline void irq_restore(unsigned long flags) {
+#ifdef __aarch64__
+    asm volatile("msr daif, %0" : : "r"(flags) : "memory");
+#endif
+}
+
+// Waits with `wfe` while the lock is held, the release of the owner wakes the core up
+static inline void spin_lock(struct spinlock *lock) {
+#ifdef __aarch64__
+    unsigned int tmp;
+    asm volatile("   sevl\n"
+                 "1: wfe\n"
+                 "2: ldaxr %w0, [%1]\n"
+                 "   cbnz %w0, 1b\n"
+                 "   stxr %w0, %w2, [%1]\n"
+                 "   cbnz %w0, 2b\n"
+                 : "=&r"(tmp) : "r"(&lock->locked), "r"(1) : "memory");
+#else
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {}
+#endif
+}
+
+// Take the lock only if it is free, return 1 if it was taken
+static inline int spin_trylock(struct spinlock *lock) {
+#ifdef __aarch64__
+    unsigned int tmp;
+    asm volatile("1: ldaxr %w0, [%1]\n"
+                 "   cbnz %w0, 2f\n"
+                 "   stxr %w0, %w2, [%1]\n"
+                 "   cbnz %w0, 1b\n"
+                 "2:\n"
+                 : "=&r"(tmp) : "r"(&lock->locked), "r"(1) : "memory");
+    return tmp == 0;
+#else
+    return __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+#endif
+}
+
+// Full barrier: the stores before it are seen by the other cores before the loads after it
+static inline void smp_mb() {
+#ifdef __aarch64__
+    asm volatile("dmb ish" : : : "memory");
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+// Sleep until an interrupt is pending, even a masked one
+static inline void wait_for_irq() {
+#ifdef __aarch64__
+    asm volatile("wfi" : : : "memory");
+#endif
+}
+
+// Read a flag another core clears with a release store, later reads see what that core wrote before it
+static inline int load_acquire(volatile int *p) {
+#ifdef __aarch64__
+    int val;
+    asm volatile("ldar %w0, [%1]" : "=r"(val) : "r"(p) : "memory");
+    return val;
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void spin_unlock(struct spinlock *lock) {
+#ifdef __aarch64__
+    asm volatile("stlr wzr, [%0]" : : "r"(&lock->locked) : "memory");
+#else
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+void smp_init();
+void secondary_main();
+int cpu_online(int cpu);
+void ipi_enable();
+void smp_send_wakeup(int cpu);
+#endif
+
+#endif /* SMP_H */
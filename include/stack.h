@@ -0,0 +1,34 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdint.h>
+#include "mm.h"
+
+#define THREAD_STACK_SIZE 0x1000  // 4KB stack size, one page
+
+// Stacks of reaped tasks kept for the next ones, see `stack_alloc`
+#ifndef STACK_POOL_HIGH
+#define STACK_POOL_HIGH 32  // Stacks kept, the extra ones go back to the page allocator
+#endif
+
+// Build with -DSTACK_POISON to fill every stack handed out with this pattern
+// and measure how deep the stacks are used when they come back
+#define STACK_POISON_WORD 0x5A5A5A5A5A5A5A5AUL
+
+struct StackStats {
+    unsigned long hit_cnt;      // Stacks taken from the pool
+    unsigned long miss_cnt;     // Stacks taken from the page allocator
+    unsigned long release_cnt;  // Stacks given back to the page allocator, the pool being full
+    int max_depth;              // Deepest use seen by the poison probe, in bytes, 0 without STACK_POISON
+};
+
+extern struct StackStats stack_stats;
+
+int stack_alloc(void **stacks, int count);
+void* stack_alloc_clean();
+void stack_free(void **stacks, int count);
+void stack_pool_init();
+int stack_pool_drain();
+int stack_pool_count();
+
+#endif /* STACK_H */
@@ -8,7 +8,8 @@
 #include "sched.h"
 #include <stddef.h>
 
-#define CORE0_TIMER_IRQ_CTRL ((volatile unsigned int *)0x40000040)
+#define CORE_TIMER_IRQ_CTRL(cpu) ((volatile unsigned int *)(0x40000040 + 4 * (cpu)))
+#define SCHED_TICK_SHIFT 8  // Scheduler tick every `get_freq() >> SCHED_TICK_SHIFT` ticks, about 4ms
 
 typedef void (*timer_callback)(char*);
 
@@ -17,6 +18,11 @@ void timer_disable_irq();
 void set_timer_irq(unsigned long long tick);
 void timer_init();
 void core_timer_handler();
+void secondary_timer_init();
+void secondary_timer_handler();
+void tick_stop();
+void tick_restart();
+void timer_rearm();
 void print_msg(char* msg);
 void print_uptime(char* _);
 unsigned long long get_tick();
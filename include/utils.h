@@ -7,6 +7,7 @@ unsigned int hex_to_uint(char *hex_str, unsigned int len);
 int atoi(char *str);
 char* itoa(int num);
 uint32_t be2le_u32(uint32_t be);
+uint64_t be2le_u64(uint64_t be);
 unsigned int align(unsigned int n, unsigned int alignment);
 
 #endif /* UTILS_H */
\ No newline at end of file
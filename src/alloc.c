@@ -1,17 +1,13 @@
 #include "alloc.h"
+#include "contig.h"
+#include "alloc_profile.h"
 
-#define MAX_CHUNK_SIZE  128
-#define MIN_CHUNK_SIZE  16
-#define MIN_CACHE_ORDER 4
-#define MAX_CACHE_ORDER 7
-#define CACHE_NUM       4
 
 extern char *__bss_begin;
 extern char *__bss_end;
 extern char *__stack_top;
 static char *heap_ptr = NULL;
 
-extern struct PageInfo page_list[PAGE_NUM];
 extern void *memory_start;
 
 void* simple_alloc(unsigned int size) {
@@ -27,179 +23,573 @@ void* simple_alloc(unsigned int size) {
     return alloc;
 }
 
-/*** Dynamic Memory Allocator (kmalloc) ***/
+/*** Slab caches ***/
+/*
+ * Objects are packed in slabs of `1 << slab_order` pages. The first page
+ * starts with a `struct slab` header that holds the owning cache, the free
+ * objects and the in-use count, objects carry no header. Every page of a slab
+ * is marked with its position in the slab, so `slab_of` finds the header of
+ * any object in O(1). Free objects are linked through their first word.
+ *
+ * A cache keeps its slabs on a partial, a full and an empty list. Empty slabs
+ * are reused first, above `SLAB_EMPTY_HIGH` of them the extra ones go back
+ * to the page allocator, and all of them do when memory runs out.
+ *
+ * kmalloc is a set of such caches, one per size class. `kmem_cache_create`
+ * adds caches for fixed size kernel objects.
+ *
+ * In front of the slabs, each core has two magazines of free objects per
+ * cache (Bonwick's magazine layer). Allocations and frees only touch the
+ * magazines of the running core, with IRQs masked and no lock. When both are
+ * empty, or both full, a whole magazine is exchanged with the depot of the
+ * cache, under the cache lock that also protects the slabs.
+ */
 struct kmem_cache kmem_caches[CACHE_NUM];
+struct kmem_cache kmem_slab_caches[MAX_SLAB_CACHES];
+int kmem_slab_cache_num = 0;
+
+static struct kmem_cache *magazine_cache = NULL;
+
+// Size classes of kmalloc, the intermediate classes keep the rounding waste under 33% above 32 bytes
+static const int kmalloc_sizes[CACHE_NUM] = {
+    8, 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
 
-void kmem_freelist_push(struct kmem_cache_entry *entry, struct kmem_cache *cache) {
-    entry->next = cache->free_list;
-    if (cache->free_list != NULL) {
-        cache->free_list->prev = entry;
+// Class of every size in steps of `1 << CLASS_SHIFT` bytes, filled by `kmem_cache_init`
+static uint8_t size_to_class[(MAX_CHUNK_SIZE >> CLASS_SHIFT) + 1];
+
+// Smallest slab order that loses at most 1/8 of the slab to the header and the tail
+static int slab_order_for(unsigned int offset, unsigned int stride) {
+    for (int order = 0; order < MAX_SLAB_ORDER; order++) {
+        unsigned int slab_size = PAGE_SIZE << order;
+        unsigned int waste = offset + (slab_size - offset) % stride;
+        if (waste * 8 <= slab_size) return order;
     }
-    cache->free_list = entry;
-    entry->prev = NULL;
+    return MAX_SLAB_ORDER;
 }
 
-void kmem_freelist_pop(struct kmem_cache *cache) {
-    struct kmem_cache_entry *tmp = cache->free_list;
-    cache->free_list = cache->free_list->next;
-    if (cache->free_list != NULL) {
-        cache->free_list->prev = NULL;
+// Fill in a cache, return -1 if the parameters are invalid
+static int kmem_cache_setup(struct kmem_cache *cache, const char *name, unsigned int size, unsigned int align, void (*ctor)(void *obj)) {
+    if (align == 0) align = sizeof(void*);
+    if ((align & (align - 1)) || align < sizeof(void*)) {
+        uart_puts("kmem_cache_create: invalid alignment\r\n");
+        return -1;
+    }
+    if (size < sizeof(void*)) size = sizeof(void*);
+
+    unsigned int stride = (size + align - 1) & ~(align - 1);
+    unsigned int offset = (sizeof(struct slab) + align - 1) & ~(align - 1);
+    if (offset + stride > (PAGE_SIZE << MAX_SLAB_ORDER)) {
+        uart_puts("kmem_cache_create: object too large for a slab\r\n");
+        return -1;
     }
-    tmp->next = NULL;
-    tmp->prev = NULL;
+
+    cache->cache_size = stride;
+    cache->name = name;
+    cache->obj_offset = offset;
+    cache->slab_order = slab_order_for(offset, stride);
+    cache->objs_per_slab = ((PAGE_SIZE << cache->slab_order) - offset) / stride;
+    cache->ctor = ctor;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->empty_cnt = 0;
+    cache->use_magazines = 1;
+    cache->lock.locked = 0;
+    cache->depot_full = NULL;
+    cache->depot_empty = NULL;
+    cache->depot_full_cnt = 0;
+    cache->pages = 0;
+    cache->in_use = 0;
+    cache->fail_cnt = 0;
+    for (int i = 0; i < NR_CPUS; i++) {
+        cache->cpu[i] = (struct kmem_cpu_cache){ 0 };
+    }
+    return 0;
 }
 
-void print_kmem_freelist() {
-    uart_puts("========== kmem Free List ==========\r\n");
+void kmem_cache_init() {
+    int cls = 0;
+    for (int i = 0; i <= (MAX_CHUNK_SIZE >> CLASS_SHIFT); i++) {
+        while (kmalloc_sizes[cls] < (i << CLASS_SHIFT)) cls++;
+        size_to_class[i] = cls;
+    }
+
+    magazine_cache = kmem_cache_create("magazine", sizeof(struct kmem_magazine), 0, NULL);
+    magazine_cache->use_magazines = 0;
     for (int i=0; i<CACHE_NUM; i++) {
-        struct kmem_cache_entry *entry = kmem_caches[i].free_list;
-        uart_puts("Cache size: ");
-        uart_puts(itoa(kmem_caches[i].cache_size));
-        uart_puts("\r\n");
-        while (entry != NULL) {
-            uart_hex((unsigned long)entry);
-            uart_puts(" -> ");
-            entry = entry->next;
+        kmem_cache_setup(&kmem_caches[i], "kmalloc", kmalloc_sizes[i], 0, NULL);
+    }
+    // Slabs are carved by the first allocation of each cache
+
+    register_shrinker("kmem", kmem_shrink_all);
+}
+
+/**
+ * kmem_cache_create - Create a cache of fixed size objects
+ *
+ * An object costs its size rounded up to `align`, instead of the next kmalloc
+ * size class or a whole page.
+ *
+ * @param name: Name shown by `meminfo`
+ * @param size: The size of each object
+ * @param align: Alignment of the objects, a power of 2, 0 for pointer alignment
+ * @param ctor: Called on each object returned by `kmem_cache_alloc`, can be NULL
+ * @return The cache, NULL if the object cannot fit in a slab or there are already `MAX_SLAB_CACHES` caches
+ */
+struct kmem_cache* kmem_cache_create(const char *name, unsigned int size, unsigned int align, void (*ctor)(void *obj)) {
+    if (kmem_slab_cache_num >= MAX_SLAB_CACHES) {
+        uart_puts("kmem_cache_create: too many caches\r\n");
+        return NULL;
+    }
+
+    struct kmem_cache *cache = &kmem_slab_caches[kmem_slab_cache_num];
+    if (kmem_cache_setup(cache, name, size, align, ctor)) {
+        return NULL;
+    }
+    kmem_slab_cache_num++;
+    return cache;
+}
+
+static void slab_link(struct slab **list, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_unlink(struct slab **list, struct slab *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+// The list a slab belongs to, from its in-use count
+static struct slab** slab_list(struct kmem_cache *cache, struct slab *slab) {
+    if (slab->in_use == 0) return &cache->empty;
+    if (slab->in_use == cache->objs_per_slab) return &cache->full;
+    return &cache->partial;
+}
+
+// The slab holding an object, NULL if the object is not in a slab
+static struct slab* slab_of(void *ptr) {
+    if (ptr < memory_start) return NULL;
+    int page_idx = (ptr - memory_start) / PAGE_SIZE;
+    if (page_idx >= page_num || !page_is_slab(page_idx)) return NULL;
+    return (struct slab*)(memory_start + (unsigned long)(page_idx - get_slab_page_pos(page_idx)) * PAGE_SIZE);
+}
+
+// Carve a new slab into objects and put it on the partial list
+static struct slab* slab_grow(struct kmem_cache *cache) {
+    void *page = _alloc_class(PAGE_SIZE << cache->slab_order, ALLOC_RECLAIMABLE);
+    if (page == NULL) return NULL;
+
+    int page_idx = (page - memory_start) / PAGE_SIZE;
+    for (int i = 0; i < (1 << cache->slab_order); i++) {
+        set_page_slab(page_idx + i, i);
+    }
+
+    struct slab *slab = (struct slab*)page;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+    for (int i = cache->objs_per_slab - 1; i >= 0; i--) {  // Lowest address first out
+        void *obj = page + cache->obj_offset + i * cache->cache_size;
+        *(void**)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    slab_link(&cache->empty, slab);
+    cache->empty_cnt++;
+    cache->pages += 1 << cache->slab_order;
+    return slab;
+}
+
+// Give an empty slab back to the page allocator
+static void slab_release(struct kmem_cache *cache, struct slab *slab) {
+    slab_unlink(&cache->empty, slab);
+    cache->empty_cnt--;
+    cache->pages -= 1 << cache->slab_order;
+
+    clear_page_slab(((void*)slab - memory_start) / PAGE_SIZE, cache->slab_order);
+    _free(slab);
+}
+
+// Take an object from the slabs, with the cache lock held
+static void* slab_alloc(struct kmem_cache *cache) {
+    // Fill partial slabs first, empty ones stay whole so that they can be released
+    struct slab *slab = cache->partial != NULL ? cache->partial : cache->empty;
+    if (slab == NULL) {
+        slab = slab_grow(cache);
+    }
+    if (slab == NULL) return NULL;
+
+    struct slab **from = slab_list(cache, slab);
+    if (from == &cache->empty) cache->empty_cnt--;
+
+    void *obj = slab->free_list;
+    slab->free_list = *(void**)obj;
+    slab->in_use++;
+    cache->in_use++;
+
+    struct slab **to = slab_list(cache, slab);
+    if (to != from) {
+        slab_unlink(from, slab);
+        slab_link(to, slab);
+    }
+    return obj;
+}
+
+// Put an object back in its slab, with the cache lock held
+static void slab_free(struct slab *slab, void *ptr) {
+    struct kmem_cache *cache = slab->cache;
+    struct slab **from = slab_list(cache, slab);
+
+    *(void**)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->in_use--;
+    cache->in_use--;
+
+    struct slab **to = slab_list(cache, slab);
+    if (to != from) {
+        slab_unlink(from, slab);
+        slab_link(to, slab);
+    }
+    if (to != &cache->empty) return;
+
+    // Hysteresis: release down to the low mark only once the high mark is passed
+    if (++cache->empty_cnt > SLAB_EMPTY_HIGH) {
+        while (cache->empty_cnt > SLAB_EMPTY_LOW) {
+            slab_release(cache, cache->empty);
         }
-        uart_puts("NULL\r\n");
     }
-    uart_puts("====================================\r\n");
 }
 
-void kmem_cache_init() {
-    for (int i=0; i<CACHE_NUM; i++) {
-        kmem_caches[i].cache_size = (1 << (i + 4)); // 16, 32, 64, 128
-        kmem_caches[i].free_list = NULL;
+// Put every object of a magazine back in its slab, with the cache lock held
+static void magazine_flush(struct kmem_cache *cache, struct kmem_magazine *mag) {
+    while (mag->count > 0) {
+        void *obj = mag->objs[--mag->count];
+        slab_free(slab_of(obj), obj);
     }
+}
 
-    for (int i=0; i<CACHE_NUM; i++) {
-        void *page = _alloc(PAGE_SIZE);
-        if (page == NULL) {
-            uart_puts("Failed to allocate memory for cache!\n");
-            return;
+static struct kmem_magazine* magazine_new() {
+    struct kmem_magazine *mag = (struct kmem_magazine*)kmem_cache_alloc(magazine_cache);
+    if (mag == NULL) return NULL;
+    mag->next = NULL;
+    mag->count = 0;
+    return mag;
+}
+
+// Both magazines of the core are empty: trade the previous one for a full magazine of the depot, or fill the loaded one from the slabs
+static int magazine_refill(struct kmem_cache *cache, struct kmem_cpu_cache *cc) {
+    if (cc->loaded == NULL) {  // First allocation on this core
+        cc->loaded = magazine_new();
+        if (cc->loaded == NULL) return -1;
+    }
+
+    spin_lock(&cache->lock);
+    struct kmem_magazine *full = cache->depot_full;
+    if (full != NULL) {
+        cache->depot_full = full->next;
+        cache->depot_full_cnt--;
+        if (cc->prev != NULL) {
+            cc->prev->next = cache->depot_empty;
+            cache->depot_empty = cc->prev;
+        }
+        cc->prev = cc->loaded;
+        cc->loaded = full;
+    }
+    else {
+        while (cc->loaded->count < MAG_REFILL) {
+            void *obj = slab_alloc(cache);
+            if (obj == NULL) break;
+            cc->loaded->objs[cc->loaded->count++] = obj;
+        }
+    }
+    spin_unlock(&cache->lock);
+    return cc->loaded->count > 0 ? 0 : -1;
+}
+
+// Both magazines of the core are full: trade the previous one for an empty magazine
+static int magazine_unload(struct kmem_cache *cache, struct kmem_cpu_cache *cc) {
+    struct kmem_magazine *empty = NULL;
+    spin_lock(&cache->lock);
+    if (cc->prev != NULL && cache->depot_full_cnt >= DEPOT_FULL_HIGH) {
+        magazine_flush(cache, cc->prev);  // The depot has enough, the objects go back to their slabs
+        empty = cc->prev;
+        cc->prev = NULL;
+    }
+    else if (cache->depot_empty != NULL) {
+        empty = cache->depot_empty;
+        cache->depot_empty = empty->next;
+    }
+    spin_unlock(&cache->lock);
+
+    if (empty == NULL) {
+        empty = magazine_new();
+        if (empty == NULL) return -1;
+    }
+
+    if (cc->prev != NULL) {
+        spin_lock(&cache->lock);
+        cc->prev->next = cache->depot_full;
+        cache->depot_full = cc->prev;
+        cache->depot_full_cnt++;
+        spin_unlock(&cache->lock);
+    }
+    cc->prev = cc->loaded;
+    cc->loaded = empty;
+    return 0;
+}
+
+// Core-local allocation, NULL if neither the depot nor the slabs have an object
+static void* magazine_alloc(struct kmem_cache *cache, struct kmem_cpu_cache *cc) {
+    if (cc->loaded == NULL || cc->loaded->count == 0) {
+        if (cc->prev != NULL && cc->prev->count > 0) {
+            struct kmem_magazine *tmp = cc->loaded;
+            cc->loaded = cc->prev;
+            cc->prev = tmp;
+        }
+        else if (magazine_refill(cache, cc)) {
+            return NULL;
         }
+    }
+    return cc->loaded->objs[--cc->loaded->count];
+}
 
-        int page_idx = (page - memory_start) / PAGE_SIZE;
-        page_list[page_idx].cache_order = i + MIN_CACHE_ORDER;
+// Core-local free, -1 if no empty magazine could be found
+static int magazine_free(struct kmem_cache *cache, struct kmem_cpu_cache *cc, void *ptr) {
+    if (cc->loaded == NULL || cc->loaded->count == MAG_SIZE) {
+        if (cc->prev != NULL && cc->prev->count < MAG_SIZE) {
+            struct kmem_magazine *tmp = cc->loaded;
+            cc->loaded = cc->prev;
+            cc->prev = tmp;
+        }
+        else if (magazine_unload(cache, cc)) {
+            return -1;
+        }
+    }
+    cc->loaded->objs[cc->loaded->count++] = ptr;
+    return 0;
+}
 
-        int chunk_size = kmem_caches[i].cache_size;
-        int chunk_num = PAGE_SIZE / (chunk_size + sizeof(struct kmem_cache_entry));
-        kmem_caches[i].free_list = NULL;
+/**
+ * kmem_cache_shrink - Release every empty slab of a cache
+ *
+ * The objects in the depot and in the magazines of the running core go back
+ * to their slabs first, and the magazines to the magazine cache. The other
+ * cores keep theirs. A cache already locked, possibly by the allocation that
+ * ran out of memory, is skipped.
+ *
+ * @return The number of pages given back to the page allocator
+ */
+int kmem_cache_shrink(struct kmem_cache *cache) {
+    unsigned long flags = irq_save();
+    if (!spin_trylock(&cache->lock)) {
+        irq_restore(flags);
+        return 0;
+    }
 
-        // Split chunks and add to the free list
-        for (int j = 0; j < chunk_num; j++) {
-            struct kmem_cache_entry *new_entry = (struct kmem_cache_entry*)page;
-            kmem_freelist_push(new_entry, &kmem_caches[i]);
-            page += chunk_size + sizeof(struct kmem_cache_entry);
+    // The magazines of this core are emptied and released with the empty ones of the depot
+    struct kmem_cpu_cache *cc = &cache->cpu[cpu_id()];
+    struct kmem_magazine *own[2] = { cc->loaded, cc->prev };
+    for (int i = 0; i < 2; i++) {
+        if (own[i] == NULL) continue;
+        magazine_flush(cache, own[i]);
+        own[i]->next = cache->depot_empty;
+        cache->depot_empty = own[i];
+    }
+    cc->loaded = NULL;
+    cc->prev = NULL;
+    while (cache->depot_full != NULL) {
+        struct kmem_magazine *mag = cache->depot_full;
+        cache->depot_full = mag->next;
+        magazine_flush(cache, mag);
+        mag->next = cache->depot_empty;
+        cache->depot_empty = mag;
+    }
+    cache->depot_full_cnt = 0;
+
+    // The magazines go back to their own cache, unless it is locked, maybe by the allocation that ran out of memory
+    if (spin_trylock(&magazine_cache->lock)) {
+        while (cache->depot_empty != NULL) {
+            struct kmem_magazine *mag = cache->depot_empty;
+            cache->depot_empty = mag->next;
+            alloc_profile_del(mag);
+            slab_free(slab_of(mag), mag);
+            magazine_cache->cpu[cpu_id()].free_cnt++;
         }
+        spin_unlock(&magazine_cache->lock);
     }
 
-    // print_free_list();
+    int pages = cache->empty_cnt << cache->slab_order;
+    while (cache->empty != NULL) {
+        slab_release(cache, cache->empty);
+    }
+    spin_unlock(&cache->lock);
+    irq_restore(flags);
+    return pages;
 }
 
-void request_page(unsigned int order) {
-    void *page = _alloc(PAGE_SIZE);
-    if (page == NULL) {
-        uart_puts("Failed to allocate memory for cache!\n");
-        return;
+// Objects handed out and given back by `kmem_cache_alloc`/`kmem_cache_free`, summed over the cores
+void kmem_cache_counts(struct kmem_cache *cache, unsigned long *alloc_cnt, unsigned long *free_cnt) {
+    *alloc_cnt = 0;
+    *free_cnt = 0;
+    for (int i = 0; i < NR_CPUS; i++) {
+        *alloc_cnt += cache->cpu[i].alloc_cnt;
+        *free_cnt += cache->cpu[i].free_cnt;
     }
+}
 
-    int page_idx = (page - memory_start) / PAGE_SIZE;
-    page_list[page_idx].cache_order = order + MIN_CACHE_ORDER;
+// Shrinker of the page allocator, shrink every cache
+int kmem_shrink_all() {
+    int pages = 0;
+    for (int i = 0; i < CACHE_NUM; i++) {
+        pages += kmem_cache_shrink(&kmem_caches[i]);
+    }
+    for (int i = 0; i < kmem_slab_cache_num; i++) {
+        pages += kmem_cache_shrink(&kmem_slab_caches[i]);
+    }
+    pages += kmem_cache_shrink(magazine_cache);  // Again, it got the magazines of the caches shrunk after it
+    return pages;
+}
 
-    int chunk_size = kmem_caches[order].cache_size;
-    int chunk_num = PAGE_SIZE / (chunk_size + sizeof(struct kmem_cache_entry));
+/**
+ * kmem_cache_alloc - Allocate an object from a cache
+ *
+ * Served by the magazines of the running core, refilled from the depot or
+ * the slabs when both are empty.
+ *
+ * @return The object, NULL if there is not enough memory
+ */
+void* kmem_cache_alloc(struct kmem_cache *cache) {
+    if (cache == NULL) return NULL;
+
+    unsigned long flags = irq_save();
+    struct kmem_cpu_cache *cc = &cache->cpu[cpu_id()];
+    void *obj = cache->use_magazines ? magazine_alloc(cache, cc) : NULL;
+    if (obj == NULL) {
+        spin_lock(&cache->lock);
+        obj = slab_alloc(cache);
+        if (obj == NULL) cache->fail_cnt++;
+        spin_unlock(&cache->lock);
+    }
+    if (obj != NULL) cc->alloc_cnt++;
+    irq_restore(flags);
 
-    // Split chunks and add to the free list
-    for (int j = 1; j < chunk_num; j++) {
-        struct kmem_cache_entry *new_entry = (struct kmem_cache_entry*)page;
-        kmem_freelist_push(new_entry, &kmem_caches[order]);
-        page += chunk_size + sizeof(struct kmem_cache_entry);
+    if (obj == NULL) {
+        uart_puts("kmem_cache_alloc: no memory for ");
+        uart_puts((char*)cache->name);
+        uart_puts("\r\n");
+        return NULL;
+    }
+    if (cache->ctor != NULL) {
+        cache->ctor(obj);
     }
+    alloc_profile_add(obj, cache->cache_size, __builtin_return_address(0));
+    return obj;
 }
 
-// Start from 4 (2^4 = 16) and go up to 7 (2^7 = 128)
-unsigned int get_chunk_order(unsigned int size) {
-    unsigned int order = 4;
-    while ((1 << order) < size) {
-        order++;
+// Give an object back through the magazines of the running core
+static void cache_free(struct kmem_cache *cache, struct slab *slab, void *ptr) {
+    unsigned long flags = irq_save();
+    struct kmem_cpu_cache *cc = &cache->cpu[cpu_id()];
+    cc->free_cnt++;
+    if (!cache->use_magazines || magazine_free(cache, cc, ptr)) {
+        spin_lock(&cache->lock);
+        slab_free(slab, ptr);
+        spin_unlock(&cache->lock);
     }
-    return order;
+    irq_restore(flags);
+}
+
+
+void kmem_cache_free(struct kmem_cache *cache, void *ptr) {
+    if (ptr == NULL) return;
+    alloc_profile_del(ptr);
+
+    struct slab *slab = slab_of(ptr);
+    if (slab == NULL || slab->cache != cache) {
+        uart_puts("[!] kmem_cache_free: object not in cache!\n");
+        return;
+    }
+    cache_free(cache, slab, ptr);
+}
+
+void print_kmem_freelist() {
+    uart_puts("========== kmem Partial Slabs ==========\r\n");
+    for (int i=0; i<CACHE_NUM + kmem_slab_cache_num; i++) {
+        struct kmem_cache *cache = i < CACHE_NUM ? &kmem_caches[i] : &kmem_slab_caches[i - CACHE_NUM];
+        uart_puts((char*)cache->name);
+        uart_puts(" size: ");
+        uart_puts(itoa(cache->cache_size));
+        uart_puts("\r\n");
+        for (struct slab *slab = cache->partial; slab != NULL; slab = slab->next) {
+            uart_hex((unsigned long)slab);
+            uart_puts("(");
+            uart_puts(itoa(slab->in_use));
+            uart_puts(") -> ");
+        }
+        uart_puts("NULL\r\n");
+    }
+    uart_puts("========================================\r\n");
+}
+
+// Smallest class that fits `size`, a single table lookup
+int get_chunk_class(unsigned int size) {
+    return size_to_class[(size + (1 << CLASS_SHIFT) - 1) >> CLASS_SHIFT];
 }
 
 /**
  * kmalloc - Allocates memory dynamically
  * 
- * This function handle the small size request for memory. It will request
- * a page using `_alloc` and split it into some common size chunks. If there
- * is no free chunk, request a new page.
+ * This function handle the small size request for memory. The request is
+ * served by the slab cache of the smallest size class in `kmalloc_sizes`
+ * that fits, the cache takes a new slab from `_alloc` when it is full.
  * 
- * @param size: The size of memory to allocate
+ * @param size: The size of memory to allocate, up to `MAX_CHUNK_SIZE`
  * @return Pointer to the allocated memory
  */
 void* kmalloc(unsigned int size) {
-    unsigned int order = get_chunk_order(size);
-    size = (1 << order);  // Round up to the nearest power of 2
-    order -= MIN_CACHE_ORDER;  // Adjust order to match cache level
-
     if (size == 0) return NULL;
     if (size > MAX_CHUNK_SIZE) {
         uart_puts("The requested size is too large for kmalloc!\n");
         return NULL;
     }
-    if (kmem_caches[order].free_list == NULL) {
-        request_page(order);
-    }
-    struct kmem_cache_entry *entry = kmem_caches[order].free_list;
-    if (entry == NULL) {
-        uart_puts("No free chunk available!\n");
-        return NULL;
-    }
-
-    // Remove from free list
-    kmem_freelist_pop(&kmem_caches[order]);
-
-    void *ptr = (void*)entry + sizeof(struct kmem_cache_entry);  // Return the memory after the entry
-    // uart_puts("[Chunk] Allocated chunk size ");
-    // uart_puts(itoa(1 << (order + MIN_CACHE_ORDER)));
-    // uart_puts(" at address ");
-    // uart_hex((unsigned long)ptr);
-    // uart_puts(" (header starts at ");
-    // uart_hex((unsigned long)entry);
-    // uart_puts(")\r\n");
-
-    return ptr;
+    return kmem_cache_alloc(&kmem_caches[get_chunk_class(size)]);
 }
 
+// Free an object of any slab cache, kmalloc or not
 void kfree(void *ptr) {
     if (ptr == NULL) return;
     if (ptr >= (void*)&__bss_end && ptr < (void*)&__stack_top) return;  // Out of bounds
 
-    int page_idx = (ptr - memory_start) / PAGE_SIZE;
-    int order = page_list[page_idx].cache_order;
-    if (order < MIN_CACHE_ORDER || order > MAX_CACHE_ORDER) {
+    struct slab *slab = slab_of(ptr);
+    if (slab == NULL) {
         uart_puts("[!] Invalid pointer to free: not in kmem cache!\n");
         return;
     }
-    struct kmem_cache_entry *entry = (struct kmem_cache_entry*)(ptr - sizeof(struct kmem_cache_entry));
-    kmem_freelist_push(entry, &kmem_caches[order - MIN_CACHE_ORDER]);
-
-    // uart_puts("[Chunk] Freed chunk size ");
-    // uart_puts(itoa(1 << (order)));
-    // uart_puts(" at address ");
-    // uart_hex((unsigned long)ptr);
-    // uart_puts(" (header starts at ");
-    // uart_hex((unsigned long)entry);
-    // uart_puts(")\r\n");
-
-    return;
+    cache_free(slab->cache, slab, ptr);
 }
 
 void* alloc(unsigned int size) {
     if (size == 0) return NULL;
 
     void *alloc = NULL;
-    if (size > MAX_CHUNK_SIZE) {
+    if (size > MAX_ALLOC_SIZE) {
+        alloc = alloc_contig(size, PAGE_SIZE);
+    }
+    else if (size > MAX_CHUNK_SIZE) {
         alloc = _alloc(size);
     }
     else {
@@ -211,22 +601,28 @@ void* alloc(unsigned int size) {
         uart_puts("Failed to allocate memory!\n");
         return NULL;
     }
+    alloc_profile_add(alloc, size, __builtin_return_address(0));
     return alloc;
 }
 
 void free(void *ptr) {
     if (ptr == NULL) return;
     if (ptr >= (void*)&__bss_end && ptr < (void*)&__stack_top) return;  // Out of bounds
+    alloc_profile_del(ptr);
+    if (contig_contains(ptr)) {
+        free_contig(ptr);
+        return;
+    }
 
     // Find the corresponding page index
     int page_idx = (ptr - memory_start) / PAGE_SIZE;
 
-    if (page_idx < 0 || page_idx >= PAGE_NUM) {
+    if (page_idx < 0 || page_idx >= page_num) {
         uart_puts("[!] Invalid pointer to free: page index out of bounds!\n");
         return;
     }
 
-    if (page_list[page_idx].cache_order != -1) {  // This address is in kmem cache
+    if (page_is_slab(page_idx)) {  // This address is in a slab cache
         kfree(ptr);
         // print_kmem_freelit();
     }
@@ -236,6 +632,77 @@ void free(void *ptr) {
     return;
 }
 
+// `krealloc` without the profiling, the caller of `krealloc` is charged for the result
+static void* resize_alloc(void *ptr, unsigned int new_size) {
+    if (ptr == NULL) return alloc(new_size);
+    if (new_size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    unsigned long old_size = 0;
+    int alloc_class = ALLOC_UNMOVABLE;
+    if (contig_contains(ptr)) {
+        old_size = contig_size(ptr);
+    }
+    else if (ptr >= memory_start && (ptr - memory_start) / PAGE_SIZE < page_num) {
+        struct slab *slab = slab_of(ptr);
+        if (slab != NULL) {
+            old_size = slab->cache->cache_size;
+        }
+        else {
+            if (_resize_in_place(ptr, new_size) == 0) return ptr;
+            old_size = _block_size(ptr);
+            alloc_class = block_alloc_class(ptr);
+        }
+    }
+    if (old_size == 0) {
+        uart_puts("[!] krealloc: invalid pointer!\n");
+        return NULL;
+    }
+    if (new_size <= old_size) {
+        return ptr;
+    }
+
+    void *new_ptr = NULL;
+    if (new_size > MAX_ALLOC_SIZE) {
+        new_ptr = alloc_contig(new_size, PAGE_SIZE);
+    }
+    else if (new_size > MAX_CHUNK_SIZE) {
+        new_ptr = _alloc_class(new_size, alloc_class);
+    }
+    else {
+        new_ptr = kmalloc(new_size);
+    }
+    if (new_ptr == NULL) {
+        uart_puts("Failed to allocate memory!\n");
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    free(ptr);
+    return new_ptr;
+}
+
+/**
+ * krealloc - Resize an allocation, keeping its content
+ *
+ * Page blocks grow in place when their buddies are free, and shrink in place.
+ * Otherwise the data is copied to a new allocation of the same kind (slab,
+ * page block of the same class, or contiguous region) and the old one freed.
+ * Slab objects and contiguous allocations are kept as they are when the new
+ * size still fits.
+ *
+ * @param ptr: Memory returned by `alloc`, `kmalloc` or `_alloc`, NULL to allocate
+ * @param new_size: The new size in bytes, 0 to free `ptr`
+ * @return The resized memory, NULL if there is not enough memory, `ptr` is then left untouched
+ */
+void* krealloc(void *ptr, unsigned int new_size) {
+    void *new_ptr = resize_alloc(ptr, new_size);
+    alloc_profile_add(new_ptr, new_size, __builtin_return_address(0));
+    return new_ptr;
+}
+
 void test_alloc() {
     uart_puts("Testing memory allocation...\n");
     char *ptr1 = (char *)alloc(4000);
@@ -0,0 +1,215 @@
+#include "alloc_profile.h"
+#include "uart.h"
+#include "utils.h"
+#include "timer.h"
+#include "smp.h"
+
+/*
+ * Allocation site profiling, built with -DALLOC_PROFILE.
+ *
+ * `alloc`, `krealloc`, `kmem_cache_alloc` and `strdup` report each allocation
+ * with the return address of their caller, the frees report the pointer. Live
+ * allocations are kept in an open addressing table keyed by pointer, so a free
+ * is charged to the site that made the allocation. Sites are return addresses,
+ * resolve them with `aarch64-linux-gnu-addr2line -f -e build/kernel8.elf`.
+ */
+#ifdef ALLOC_PROFILE
+struct AllocSite {
+    void *site;                 // Return address of the call to the allocator
+    unsigned long live_bytes;
+    unsigned long peak_bytes;
+    unsigned long alloc_cnt;
+    unsigned long free_cnt;
+};
+
+struct AllocObj {
+    void *ptr;          // NULL for an empty slot
+    unsigned int size;
+    int site;           // Index in `sites`
+};
+
+static struct AllocSite sites[ALLOC_PROFILE_SITES];
+static int site_num = 0;
+static struct AllocObj objs[ALLOC_PROFILE_OBJS];
+static int obj_num = 0;
+static unsigned long untracked_cnt = 0;  // Allocations not recorded, a table being full
+static unsigned long long start_tick = 0;
+static struct spinlock profile_lock;  // The tables, allocations are recorded from every core
+
+static inline int obj_hash(void *ptr) {
+    unsigned long p = (unsigned long)ptr >> 3;
+    return (p ^ (p >> 12)) & (ALLOC_PROFILE_OBJS - 1);
+}
+
+// Slot holding `ptr`, or the empty slot ending its probe sequence
+static int obj_find(void *ptr) {
+    int i = obj_hash(ptr);
+    while (objs[i].ptr != NULL && objs[i].ptr != ptr) {
+        i = (i + 1) & (ALLOC_PROFILE_OBJS - 1);
+    }
+    return i;
+}
+
+static int site_index(void *site) {
+    for (int i = 0; i < site_num; i++) {
+        if (sites[i].site == site) return i;
+    }
+    if (site_num == ALLOC_PROFILE_SITES) return -1;
+
+    sites[site_num] = (struct AllocSite){ .site = site };
+    return site_num++;
+}
+
+/**
+ * alloc_profile_add - Record an allocation
+ *
+ * An allocation already recorded at `ptr` moves to the new site and size
+ * instead of counting twice: `krealloc` resizing in place, or wrappers like
+ * `strdup` charging the allocation to their own caller.
+ *
+ * @param ptr: The allocated memory, ignored if NULL
+ * @param size: Bytes requested
+ * @param site: Return address of the caller, `__builtin_return_address(0)`
+ */
+void alloc_profile_add(void *ptr, unsigned int size, void *site) {
+    if (ptr == NULL) return;
+    unsigned long flags = irq_save();
+    spin_lock(&profile_lock);
+    if (start_tick == 0) start_tick = get_tick();
+
+    int s = site_index(site);
+    int i = obj_find(ptr);
+    if (s < 0 || (objs[i].ptr == NULL && obj_num == ALLOC_PROFILE_OBJS - 1)) {  // Keep an empty slot to end the probes
+        untracked_cnt++;
+        spin_unlock(&profile_lock);
+        irq_restore(flags);
+        return;
+    }
+
+    if (objs[i].ptr == ptr) {
+        sites[objs[i].site].live_bytes -= objs[i].size;
+        sites[objs[i].site].alloc_cnt--;
+    }
+    else {
+        obj_num++;
+    }
+    objs[i] = (struct AllocObj){ .ptr = ptr, .size = size, .site = s };
+
+    sites[s].live_bytes += size;
+    if (sites[s].live_bytes > sites[s].peak_bytes) sites[s].peak_bytes = sites[s].live_bytes;
+    sites[s].alloc_cnt++;
+    spin_unlock(&profile_lock);
+    irq_restore(flags);
+}
+
+// Record a free, pointers that were never recorded are ignored
+void alloc_profile_del(void *ptr) {
+    if (ptr == NULL) return;
+
+    unsigned long flags = irq_save();
+    spin_lock(&profile_lock);
+    int i = obj_find(ptr);
+    if (objs[i].ptr == NULL) {
+        spin_unlock(&profile_lock);
+        irq_restore(flags);
+        return;
+    }
+
+    struct AllocSite *site = &sites[objs[i].site];
+    site->live_bytes -= objs[i].size;
+    site->free_cnt++;
+    obj_num--;
+
+    // Shift back the entries of the probe sequence that follows, no tombstones
+    int j = i;
+    while (1) {
+        j = (j + 1) & (ALLOC_PROFILE_OBJS - 1);
+        if (objs[j].ptr == NULL) break;
+        int k = obj_hash(objs[j].ptr);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;  // Already reachable from its home slot
+        objs[i] = objs[j];
+        i = j;
+    }
+    objs[i].ptr = NULL;
+    spin_unlock(&profile_lock);
+    irq_restore(flags);
+}
+
+// Forget every site and allocation, the rates are measured from now on
+void alloc_profile_reset() {
+    unsigned long flags = irq_save();
+    spin_lock(&profile_lock);  // Another core may be recording into the tables
+    for (int i = 0; i < ALLOC_PROFILE_OBJS; i++) {
+        objs[i].ptr = NULL;
+    }
+    obj_num = 0;
+    site_num = 0;
+    untracked_cnt = 0;
+    start_tick = get_tick();
+    spin_unlock(&profile_lock);
+    irq_restore(flags);
+}
+
+static unsigned long site_rate(struct AllocSite *site, unsigned long long ticks) {
+    if (ticks == 0) return site->alloc_cnt;
+    return (unsigned long long)site->alloc_cnt * get_freq() / ticks;
+}
+
+/**
+ * print_alloc_profile - Print the call sites, the biggest first
+ *
+ * @param sort_by: `ALLOC_PROFILE_BY_BYTES` or `ALLOC_PROFILE_BY_RATE`
+ */
+void print_alloc_profile(int sort_by) {
+    unsigned long long ticks = start_tick ? get_tick() - start_tick : 0;
+    int order[ALLOC_PROFILE_SITES];
+    for (int i = 0; i < site_num; i++) {
+        order[i] = i;
+    }
+
+    // Selection sort, there are few sites
+    for (int i = 0; i < site_num; i++) {
+        int best = i;
+        for (int j = i + 1; j < site_num; j++) {
+            struct AllocSite *a = &sites[order[j]], *b = &sites[order[best]];
+            unsigned long ka = sort_by == ALLOC_PROFILE_BY_RATE ? a->alloc_cnt : a->live_bytes;
+            unsigned long kb = sort_by == ALLOC_PROFILE_BY_RATE ? b->alloc_cnt : b->live_bytes;
+            if (ka > kb) best = j;
+        }
+        int tmp = order[i];
+        order[i] = order[best];
+        order[best] = tmp;
+    }
+
+    uart_puts("site live_bytes peak_bytes allocs frees allocs/s\r\n");
+    for (int i = 0; i < site_num; i++) {
+        struct AllocSite *site = &sites[order[i]];
+        if (site->alloc_cnt == 0 && site->free_cnt == 0) continue;  // Every allocation moved to another site
+        uart_hex((unsigned long)site->site);
+        uart_puts(" ");
+        uart_puts(itoa(site->live_bytes));
+        uart_puts(" ");
+        uart_puts(itoa(site->peak_bytes));
+        uart_puts(" ");
+        uart_puts(itoa(site->alloc_cnt));
+        uart_puts(" ");
+        uart_puts(itoa(site->free_cnt));
+        uart_puts(" ");
+        uart_puts(itoa(site_rate(site, ticks)));
+        uart_puts("\r\n");
+    }
+    uart_puts("live allocations: ");
+    uart_puts(itoa(obj_num));
+    uart_puts(", untracked: ");
+    uart_puts(itoa(untracked_cnt));
+    uart_puts(", seconds: ");
+    uart_puts(itoa(ticks / get_freq()));
+    uart_puts("\r\n");
+}
+#else
+void alloc_profile_reset() {}
+
+void print_alloc_profile(int sort_by) {
+    uart_puts("Allocation profiling is off, build with `make DEFS=-DALLOC_PROFILE`\r\n");
+}
+#endif
@@ -0,0 +1,225 @@
+#include "contig.h"
+
+/*
+ * Contiguous memory region.
+ *
+ * The buddy allocator cannot hand out more than `MAX_ALLOC_SIZE` at once. A
+ * region is reserved from the boot memory map before `mm_init`, so the buddy
+ * allocator never sees it, and it is managed with two page bitmaps: `used`
+ * marks allocated pages, `last` marks the last page of each allocation so
+ * that `free_contig` knows where an allocation ends.
+ */
+static void *contig_base = NULL;
+static int contig_pages = 0;
+static uint64_t *contig_used = NULL;
+static uint64_t *contig_last = NULL;
+static int contig_used_pages = 0;
+static struct spinlock contig_lock;  // The bitmaps
+
+static inline int test_bit(uint64_t *map, int i) {
+    return (map[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void set_bit(uint64_t *map, int i) {
+    map[i >> 6] |= (1UL << (i & 63));
+}
+
+static inline void clear_bit(uint64_t *map, int i) {
+    map[i >> 6] &= ~(1UL << (i & 63));
+}
+
+/**
+ * contig_parse_size - Read the size of the region from the kernel command line
+ *
+ * Accepts `cma=<number>[K|M|G]`, e.g. `cma=128M`. `cma=0` disables the region.
+ *
+ * @param bootargs: The `bootargs` property of `/chosen`, may be NULL
+ * @return The size in bytes, `CONTIG_DEFAULT_SIZE` if the option is absent
+ */
+unsigned long contig_parse_size(const char *bootargs) {
+    if (bootargs == NULL) return CONTIG_DEFAULT_SIZE;
+
+    const char *p = bootargs;
+    while (*p) {
+        if ((p == bootargs || p[-1] == ' ') && p[0] == 'c' && p[1] == 'm' && p[2] == 'a' && p[3] == '=') {
+            p += 4;
+            unsigned long size = 0;
+            while (*p >= '0' && *p <= '9') {
+                size = size * 10 + (*p++ - '0');
+            }
+            if (*p == 'K' || *p == 'k') size <<= 10;
+            else if (*p == 'M' || *p == 'm') size <<= 20;
+            else if (*p == 'G' || *p == 'g') size <<= 30;
+            return size;
+        }
+        p++;
+    }
+    return CONTIG_DEFAULT_SIZE;
+}
+
+/**
+ * contig_init - Reserve the contiguous region from the boot memory map
+ *
+ * Must be called after the memory is registered with `memblock_add` and
+ * before `mm_init`.
+ *
+ * @param size: Size of the region in bytes, 0 to disable it
+ * @return 0 on success, -1 if the region could not be reserved
+ */
+int contig_init(unsigned long size) {
+    size = PAGE_ALIGN(size);
+    if (size == 0) return 0;
+
+    int pages = size / PAGE_SIZE;
+    unsigned long map_size = ((pages + 63) / 64) * sizeof(uint64_t);
+    uint64_t *maps = memblock_alloc(map_size * 2, sizeof(uint64_t));
+    void *base = memblock_alloc(size, CONTIG_ALIGN);
+    if (maps == NULL || base == NULL) {
+        uart_puts("Failed to reserve the contiguous memory region!\r\n");
+        return -1;
+    }
+    memset(maps, 0, map_size * 2);
+
+    contig_base = base;
+    contig_pages = pages;
+    contig_used = maps;
+    contig_last = maps + map_size / sizeof(uint64_t);
+
+    uart_puts("Contiguous region: ");
+    uart_hex((unsigned long)base);
+    uart_puts(" - ");
+    uart_hex((unsigned long)base + size);
+    uart_puts("\r\n");
+    return 0;
+}
+
+int contig_contains(void *ptr) {
+    return contig_base != NULL && ptr >= contig_base && ptr < contig_base + (unsigned long)contig_pages * PAGE_SIZE;
+}
+
+// Best fit of `pages` pages aligned to `align_pages` in the region, -1 if nothing fits
+static int contig_find(int pages, int align_pages) {
+    int base_idx = ((unsigned long)contig_base / PAGE_SIZE) & (align_pages - 1);  // Alignment is on physical addresses
+    int best = -1;
+    int best_len = 0;
+
+    int i = 0;
+    while (i < contig_pages) {
+        // Skip allocated pages, a whole word at a time when possible
+        if ((i & 63) == 0 && contig_used[i >> 6] == ~0UL) {
+            i += 64;
+            continue;
+        }
+        if (test_bit(contig_used, i)) {
+            i++;
+            continue;
+        }
+
+        // Free run [run_start, i)
+        int run_start = i;
+        while (i < contig_pages && !test_bit(contig_used, i)) {
+            if ((i & 63) == 0 && contig_used[i >> 6] == 0 && i + 64 <= contig_pages) i += 64;
+            else i++;
+        }
+        int run_len = i - run_start;
+
+        int start = run_start + ((align_pages - ((run_start + base_idx) & (align_pages - 1))) & (align_pages - 1));
+        if (start + pages <= i && (best < 0 || run_len < best_len)) {
+            best = start;
+            best_len = run_len;
+            if (run_len == pages) break;  // Exact fit
+        }
+    }
+    return best;
+}
+
+/**
+ * alloc_contig - Allocate physically contiguous memory of any size
+ *
+ * Requests the buddy allocator can serve with the requested alignment go to
+ * `_alloc`, buddy blocks being aligned to their size. Bigger ones are carved
+ * from the contiguous region with a best-fit search.
+ *
+ * @param size: The size of memory to allocate
+ * @param align: Alignment in bytes, a power of two. Anything below
+ *               `PAGE_SIZE` means page aligned
+ * @return Pointer to the allocated memory, NULL on failure
+ */
+void* alloc_contig(unsigned long size, unsigned long align) {
+    if (size == 0) return NULL;
+    if (align < PAGE_SIZE) align = PAGE_SIZE;
+
+    unsigned long buddy_size = size > align ? size : align;
+    if (buddy_size <= MAX_ALLOC_SIZE) {
+        void *ptr = _alloc(buddy_size);
+        if (ptr != NULL) return ptr;
+    }
+    if (contig_base == NULL) return NULL;
+
+    int pages = PAGE_ALIGN(size) / PAGE_SIZE;
+    unsigned long flags = irq_save();
+    spin_lock(&contig_lock);
+    int start = contig_find(pages, align / PAGE_SIZE);
+    if (start >= 0) {
+        for (int i = start; i < start + pages; i++) {
+            set_bit(contig_used, i);
+        }
+        set_bit(contig_last, start + pages - 1);
+        contig_used_pages += pages;
+    }
+    spin_unlock(&contig_lock);
+    irq_restore(flags);
+
+    if (start < 0) return NULL;
+    return contig_base + (unsigned long)start * PAGE_SIZE;
+}
+
+// Free memory from `alloc_contig`, pointers outside the region go back to the buddy allocator
+void free_contig(void *ptr) {
+    if (ptr == NULL) return;
+    if (!contig_contains(ptr)) {
+        _free(ptr);
+        return;
+    }
+
+    int i = (ptr - contig_base) / PAGE_SIZE;
+    unsigned long flags = irq_save();
+    spin_lock(&contig_lock);
+    if (!test_bit(contig_used, i) || (i > 0 && test_bit(contig_used, i - 1) && !test_bit(contig_last, i - 1))) {
+        spin_unlock(&contig_lock);
+        irq_restore(flags);
+        uart_puts("[!] Invalid pointer to free: not the start of a contiguous allocation!\r\n");
+        return;
+    }
+    while (i < contig_pages) {
+        int last = test_bit(contig_last, i);
+        clear_bit(contig_used, i);
+        clear_bit(contig_last, i);
+        contig_used_pages--;
+        if (last) break;
+        i++;
+    }
+    spin_unlock(&contig_lock);
+    irq_restore(flags);
+}
+
+// Size in bytes of the allocation starting at `ptr`, 0 if `ptr` is not the start of one
+unsigned long contig_size(void *ptr) {
+    if (!contig_contains(ptr)) return 0;
+
+    int i = (ptr - contig_base) / PAGE_SIZE;
+    if (!test_bit(contig_used, i) || (i > 0 && test_bit(contig_used, i - 1) && !test_bit(contig_last, i - 1))) {
+        return 0;
+    }
+    int start = i;
+    while (i < contig_pages - 1 && !test_bit(contig_last, i)) {
+        i++;
+    }
+    return (unsigned long)(i - start + 1) * PAGE_SIZE;
+}
+
+// Size of the region and pages allocated from it, for `meminfo`
+void contig_usage(int *total_pages, int *used_pages) {
+    *total_pages = contig_pages;
+    *used_pages = contig_used_pages;
+}
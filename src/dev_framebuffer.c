@@ -1,4 +1,5 @@
 #include "dev_framebuffer.h"
+#include "mmu.h"
 
 unsigned int width, height, pitch, isrgb; /* dimensions and channel order */
 unsigned char *lfb;                       /* raw frame buffer address */
@@ -16,7 +17,7 @@ int dev_framebuffer_open(struct vnode* file_node, struct file** target) {
         return EINVAL_VFS;
     }
     
-    *target = (struct file*)alloc(sizeof(struct file));
+    *target = (struct file*)kmem_cache_alloc(file_cache);
     if (*target == NULL) {
         return ENOMEM_VFS;
     }
@@ -33,7 +34,7 @@ int dev_framebuffer_close(struct file* file) {
         return EINVAL_VFS;
     }
 
-    free(file);
+    kmem_cache_free(file_cache, file);
     return 0;  // Success
 }
 
@@ -44,6 +45,7 @@ int dev_framebuffer_write(struct file* file, const void* buf, size_t len) {
     if (len == 0) return 0;
 
     memcpy(lfb + file->f_pos, (void *)buf, len);
+    dcache_clean_invalidate_range(lfb + file->f_pos, len);  // The GPU scans out from memory
     file->f_pos += len;
     return len;
 }
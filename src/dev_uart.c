@@ -13,7 +13,7 @@ int dev_uart_open(struct vnode* file_node, struct file** target) {
         return EINVAL_VFS;
     }
     
-    *target = (struct file*)alloc(sizeof(struct file));
+    *target = (struct file*)kmem_cache_alloc(file_cache);
     if (*target == NULL) {
         return ENOMEM_VFS;
     }
@@ -30,7 +30,7 @@ int dev_uart_close(struct file* file) {
         return EINVAL_VFS;
     }
 
-    free(file);
+    kmem_cache_free(file_cache, file);
     return 0;  // Success
 }
 
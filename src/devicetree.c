@@ -4,6 +4,7 @@
 static const void* g_fdt_base = NULL;
 static const char* g_fdt_strings = NULL;
 static const void* g_fdt_structure = NULL;
+static const void* g_fdt_rsvmap = NULL;
 uint32_t fdt_total_size = 0;
 static uint32_t g_fdt_strings_size = 0;
 static uint32_t g_fdt_structure_size = 0;
@@ -26,6 +27,7 @@ int fdt_init(const void* fdt_base) {
     fdt_total_size = header->totalsize;
     g_fdt_structure = (const char*)fdt_base + be2le_u32(header->off_dt_struct);
     g_fdt_strings = (const char*)fdt_base + be2le_u32(header->off_dt_strings);
+    g_fdt_rsvmap = (const char*)fdt_base + be2le_u32(header->off_mem_rsvmap);
     g_fdt_strings_size = be2le_u32(header->size_dt_strings);
     g_fdt_structure_size = be2le_u32(header->size_dt_struct);
 
@@ -106,6 +108,27 @@ int fdt_traverse(fdt_callback callback) {
     return fdt_parse_node(&ptr, callback);
 }
 
+/**
+ * fdt_traverse_rsvmap - Walk the memory reservation block
+ *
+ * @param callback: Called with each reserved range, the list ends with an
+ *                  entry whose address and size are both 0
+ * @return 0 for success, -1 if the FDT is not initialized
+ */
+int fdt_traverse_rsvmap(fdt_rsvmap_callback callback) {
+    if (!g_fdt_base || !g_fdt_rsvmap) return -1;
+
+    const struct fdt_reserve_entry* entry = (const struct fdt_reserve_entry*)g_fdt_rsvmap;
+    while (1) {
+        uint64_t address = be2le_u64(entry->address);
+        uint64_t size = be2le_u64(entry->size);
+        if (address == 0 && size == 0) break;
+        if (callback) callback(address, size);
+        entry++;
+    }
+    return 0;
+}
+
 void fdt_print_header(const struct fdt_header* header) {
     uart_puts("FDT Header:\n");
     uart_puts("  magic: ");
@@ -150,4 +173,60 @@ int initramfs_callback(int type, const char* name, const void* data, uint32_t si
         cpio_end = be2le_u32(*(uint32_t*)data);
     }
     return 0;
-}
\ No newline at end of file
+}
+
+const char* fdt_bootargs = NULL;  // Kernel command line, `bootargs` of `/chosen`
+
+int bootargs_callback(int type, const char* name, const void* data, uint32_t size, void* user_data) {
+    if (type == FDT_PROP && strcmp(name, "bootargs") == 0 && size > 0) {
+        fdt_bootargs = (const char*)data;
+    }
+    return 0;
+}
+
+/* State of `memory_callback`, filled with the first range of the `/memory` node */
+uint64_t fdt_memory_base = 0;
+uint64_t fdt_memory_size = 0;
+static int fdt_depth = 0;
+static int in_memory_node = 0;
+static uint32_t root_address_cells = 2;  // Default values from the devicetree specification
+static uint32_t root_size_cells = 1;
+
+// Match "memory" and "memory@<unit-address>"
+static int is_memory_node(const char* name) {
+    const char* prefix = "memory";
+    while (*prefix) {
+        if (*name++ != *prefix++) return 0;
+    }
+    return *name == '\0' || *name == '@';
+}
+
+static uint64_t fdt_read_cells(const uint32_t* cells, uint32_t num) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        value = (value << 32) | be2le_u32(cells[i]);
+    }
+    return value;
+}
+
+int memory_callback(int type, const char* name, const void* data, uint32_t size, void* user_data) {
+    if (type == FDT_BEGIN_NODE) {
+        fdt_depth++;
+        if (fdt_depth == 2 && is_memory_node(name)) in_memory_node = 1;
+    }
+    else if (type == FDT_END_NODE) {
+        if (fdt_depth == 2) in_memory_node = 0;
+        fdt_depth--;
+    }
+    else if (type == FDT_PROP && fdt_depth == 1) {  // Properties of the root node
+        if (strcmp(name, "#address-cells") == 0) root_address_cells = be2le_u32(*(uint32_t*)data);
+        else if (strcmp(name, "#size-cells") == 0) root_size_cells = be2le_u32(*(uint32_t*)data);
+    }
+    else if (type == FDT_PROP && in_memory_node && strcmp(name, "reg") == 0) {
+        if (fdt_memory_size != 0) return 0;  // Only the first range is used
+        if (size < (root_address_cells + root_size_cells) * sizeof(uint32_t)) return 0;
+        fdt_memory_base = fdt_read_cells((const uint32_t*)data, root_address_cells);
+        fdt_memory_size = fdt_read_cells((const uint32_t*)data + root_address_cells, root_size_cells);
+    }
+    return 0;
+}
@@ -39,14 +39,27 @@ void exception_entry() {
  * This function is called when an interrupt occurs. It checks the
  * pending interrupts and calls the appropriate handler.
  *
- * The function handles the core timer interrupt and the UART interrupt.
+ * The function handles the core timer interrupt and the UART interrupt. The
+ * GPU interrupts are routed to core 0, the other cores only get the
+ * interrupts of their own timer, the scheduler tick. Any core may get a
+ * wake-up in its mailbox 0, which only has to bring it out of `wfi`. On
+ * core 0 it may also come from a core that added a timer at the head of the
+ * list, so core 0 rearms its timer.
  */
 void irq_entry(unsigned long sp) {
-    unsigned int irq_src = *CORE0_IRQ_SOURCE;
+    int cpu = cpu_id();
+    unsigned int irq_src = *CORE_IRQ_SOURCE(cpu);
     unsigned int pending_1 = *IRQ_PENDING_1;
 
     disable_irq_el1();
-    if (irq_src & TIMER_IRQ) {  // Timer interrupt
+    if (irq_src & MBOX0_IRQ) {
+        *CORE_MBOX0_CLR(cpu) = ~0U;
+        if (cpu == 0) timer_rearm();
+    }
+    if (cpu != 0) {
+        if (irq_src & TIMER_IRQ) secondary_timer_handler();
+    }
+    else if (irq_src & TIMER_IRQ) {  // Timer interrupt
         add_task(core_timer_handler, 0);
         execute_task();
     }
@@ -24,6 +24,8 @@ void _exec(char* filename) {
     }
 
     struct ThreadTask* new_thread = thread_create(exec_addr);
+    sched_dequeue(new_thread);  // Runs now, another core must not take it from the queue as well
+    new_thread->state = TASK_RUNNING;
     asm volatile(
         "msr tpidr_el1, %0\n"
         "mov x5, 0x0\n"
@@ -2,6 +2,12 @@
 
 extern uint32_t cpio_addr;
 
+static struct kmem_cache* initramfs_node_cache = NULL;
+static struct initramfs_node* initramfs_root_node = NULL;  // Set once `initramfs_init` filled it
+
+// Held while a read copies out of `data`, the shrinker only tries it and skips the archive when it is taken
+static struct spinlock initramfs_lock;
+
 struct file_operations initramfs_f_ops = {
     .open = initramfs_open,
     .close = initramfs_close,
@@ -16,7 +22,33 @@ struct vnode_operations initramfs_v_ops = {
     .mkdir = initramfs_mkdir,
 };
 
+// Shrinker: serve the files from the archive again, it stays reserved and mapped
+static int initramfs_shrink() {
+    int pages = 0;
+    if (initramfs_root_node == NULL) return 0;
+    unsigned long flags = irq_save();
+    if (!spin_trylock(&initramfs_lock)) {
+        irq_restore(flags);
+        return 0;
+    }
+
+    for (int i = 0; i < initramfs_root_node->num_children; ++i) {
+        struct initramfs_node* node = (struct initramfs_node*)initramfs_root_node->children[i]->internal;
+        if (node->data == NULL || node->data == node->image) continue;
+
+        unsigned long copy = node->size > MAX_CHUNK_SIZE ? round(node->size) : 0;  // Slab objects free whole pages only with their slab
+        free(node->data);
+        node->data = node->image;
+        pages += copy / PAGE_SIZE;
+    }
+    spin_unlock(&initramfs_lock);
+    irq_restore(flags);
+    return pages;
+}
+
 int register_initramfs() {
+    initramfs_node_cache = kmem_cache_create("initramfs_node", sizeof(struct initramfs_node), 0, NULL);
+    register_shrinker("initramfs", initramfs_shrink);
     struct filesystem* initramfs_fs = (struct filesystem*)alloc(sizeof(struct filesystem));
     initramfs_fs->name = "initramfs";
     initramfs_fs->setup_mount = initramfs_setup_mount;
@@ -29,18 +61,18 @@ int initramfs_setup_mount(struct filesystem* fs, struct mount* mount) {
     }
 
     // TODO
-    struct initramfs_node* initramfs_root = (struct initramfs_node*)alloc(sizeof(struct initramfs_node));
+    struct initramfs_node* initramfs_root = (struct initramfs_node*)kmem_cache_alloc(initramfs_node_cache);
     if (!initramfs_root) {
         uart_puts("initramfs_setup_mount: Failed to create root internal node\r\n");
         return ENOMEM_VFS;
     }
 
     mount->fs = fs;
-    mount->root = (struct vnode*)alloc(sizeof(struct vnode));
+    mount->root = (struct vnode*)kmem_cache_alloc(vnode_cache);
     if (mount->root == NULL) {
         uart_puts("initramfs_setup_mount: Failed to allocate memory for root vnode\r\n");
         if (initramfs_root->data) free(initramfs_root->data); // Clean up allocated internal node data
-        free(initramfs_root); // Clean up allocated internal node
+        kmem_cache_free(initramfs_node_cache, initramfs_root); // Clean up allocated internal node
         return ENOMEM_VFS;
     }
 
@@ -74,21 +106,29 @@ void initramfs_init(struct vnode* rootvnode) {
                 break;
             }
 
-            struct initramfs_node* new_node = (struct initramfs_node*)alloc(sizeof(struct initramfs_node));
+            struct initramfs_node* new_node = (struct initramfs_node*)kmem_cache_alloc(initramfs_node_cache);
             memcpy(new_node->name, filename, filenamesize);
             new_node->name[filenamesize] = '\0';
             new_node->type = INITRAMFS_NODE_FILE;
             new_node->parent = NULL; // Will be set later
             new_node->size = filesize;
-            new_node->data = alloc(filesize);
-            memcpy(new_node->data, (char *)header + align(HEADER_SIZE + filenamesize, 4), filesize);
+            // Served from a copy while memory allows, the shrinker points `data` back to the archive.
+            // Without memory for the copy, the file is served from the archive from the start
+            new_node->image = (char *)header + align(HEADER_SIZE + filenamesize, 4);
+            new_node->data = filesize > 0 ? alloc(filesize) : NULL;
+            if (new_node->data) {
+                memcpy(new_node->data, new_node->image, filesize);
+            }
+            else {
+                new_node->data = new_node->image;
+            }
             new_node->capacity = filesize;
             new_node->num_children = 0;
             for (int i = 0; i < MAX_CHILDREN; ++i) {
                 new_node->children[i] = NULL;
             }
 
-            struct vnode* new_vnode = (struct vnode*)alloc(sizeof(struct vnode));
+            struct vnode* new_vnode = (struct vnode*)kmem_cache_alloc(vnode_cache);
             new_vnode->mount = 0;
             new_vnode->v_ops = &initramfs_v_ops;
             new_vnode->f_ops = &initramfs_f_ops;
@@ -108,6 +148,8 @@ void initramfs_init(struct vnode* rootvnode) {
             break;
         }
     }
+    // Published last: the allocations above may run the shrinker, which must not see a half-built list
+    initramfs_root_node = (struct initramfs_node*)rootvnode->internal;
 }
 
 int initramfs_lookup(struct vnode* dir_node, struct vnode** target, const char* component_name) {
@@ -168,7 +210,7 @@ int initramfs_write(struct file* file, const void* buf, size_t len) {
     return EACCES_VFS;  // read-only filesystem
 }
 
-int initramfs_read(struct file* file, void* buf, size_t len) {
+static int initramfs_read_locked(struct file* file, void* buf, size_t len) {
     if (!file || !file->vnode || !file->vnode->internal || !buf) {
         return EINVAL_VFS;
     }
@@ -193,6 +235,16 @@ int initramfs_read(struct file* file, void* buf, size_t len) {
     return readable_len;
 }
 
+// The shrinker would free the copy under the `memcpy`
+int initramfs_read(struct file* file, void* buf, size_t len) {
+    unsigned long flags = irq_save();
+    spin_lock(&initramfs_lock);
+    int ret = initramfs_read_locked(file, buf, len);
+    spin_unlock(&initramfs_lock);
+    irq_restore(flags);
+    return ret;
+}
+
 long initramfs_lseek64(struct file* file, long offset, int whence) {
     if (!file || !file->vnode || !file->vnode->internal) {
         return EINVAL_VFS;
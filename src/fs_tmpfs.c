@@ -1,4 +1,28 @@
 # include "fs_tmpfs.h"
+#include "contig.h"
+
+static struct kmem_cache* tmpfs_node_cache = NULL;
+static struct tmpfs_node* tmpfs_roots[MAX_TMPFS_MOUNTS];  // Walked by the shrinker
+static int tmpfs_root_num = 0;
+
+/*
+ * The directory trees and the file buffers. The shrinker runs inside any
+ * allocation, from any core and from IRQs, possibly in the middle of a write
+ * that holds this lock: it only tries the lock and skips tmpfs when it is
+ * taken. IRQs stay masked while it is held.
+ */
+static struct spinlock tmpfs_lock;
+
+static unsigned long tmpfs_lock_irqsave() {
+    unsigned long flags = irq_save();
+    spin_lock(&tmpfs_lock);
+    return flags;
+}
+
+static void tmpfs_unlock_irqrestore(unsigned long flags) {
+    spin_unlock(&tmpfs_lock);
+    irq_restore(flags);
+}
 
 struct vnode_operations tmpfs_v_ops = {
     .lookup = tmpfs_lookup,
@@ -14,8 +38,14 @@ struct file_operations tmpfs_f_ops = {
     .lseek64 = tmpfs_lseek64,
 };
 
+// File data is short-lived, files too big for the buddy allocator go to the contiguous region
+static char* tmpfs_alloc_data(size_t size) {
+    if (size > MAX_ALLOC_SIZE) return (char*)alloc_contig(size, PAGE_SIZE);
+    return (char*)_alloc_class(size, ALLOC_TEMPORARY);
+}
+
 struct tmpfs_node* tmpfs_create_internal_node(const char* name, tmpfs_node_type_t type, struct tmpfs_node* parent) {
-    struct tmpfs_node* new_node = (struct tmpfs_node*)alloc(sizeof(struct tmpfs_node));
+    struct tmpfs_node* new_node = (struct tmpfs_node*)kmem_cache_alloc(tmpfs_node_cache);
     if (!new_node) {
         uart_puts("tmpfs_create_internal_node: Failed to allocate memory for node\\\r\n");
         return NULL;
@@ -35,10 +65,10 @@ struct tmpfs_node* tmpfs_create_internal_node(const char* name, tmpfs_node_type_
     }
 
     if (type == TMPFS_NODE_FILE) {
-        new_node->data = (char*)alloc(DEFAULT_FILE_SIZE);
+        new_node->data = (char*)_alloc_zeroed(DEFAULT_FILE_SIZE);
         if (!new_node->data) {
             uart_puts("tmpfs_create_internal_node: Failed to allocate memory for file data\r\n");
-            free(new_node);
+            kmem_cache_free(tmpfs_node_cache, new_node);
             return NULL;
         }
         new_node->capacity = DEFAULT_FILE_SIZE;
@@ -46,8 +76,52 @@ struct tmpfs_node* tmpfs_create_internal_node(const char* name, tmpfs_node_type_
     return new_node;
 }
 
+// Release the buffer of an empty file, or the pages of a buffer past the power of two that holds the file
+static int tmpfs_trim_node(struct tmpfs_node* node) {
+    int pages = 0;
+    if (node->type == TMPFS_NODE_DIRECTORY) {
+        for (int i = 0; i < node->num_children; ++i) {
+            pages += tmpfs_trim_node((struct tmpfs_node*)node->children[i]->internal);
+        }
+        return pages;
+    }
+
+    unsigned long block = node->data && !contig_contains(node->data) ? _block_size(node->data) : 0;
+    if (block == 0) return 0;  // Not a page block: nothing, or a contiguous region allocation
+    if (node->size == 0) {
+        free(node->data);
+        node->data = NULL;  // `tmpfs_write` allocates again
+        node->capacity = 0;
+        return block / PAGE_SIZE;
+    }
+
+    unsigned long need = (unsigned long)PAGE_SIZE << get_order(round(node->size));
+    if (need < block && _resize_in_place(node->data, need) == 0) {
+        node->capacity = need;
+        pages = (block - need) / PAGE_SIZE;
+    }
+    return pages;
+}
+
+// Shrinker: every created file holds a page before anything is written to it
+static int tmpfs_shrink() {
+    unsigned long flags = irq_save();
+    if (!spin_trylock(&tmpfs_lock)) {  // A tmpfs operation is under way, maybe the allocation that called us
+        irq_restore(flags);
+        return 0;
+    }
+    int pages = 0;
+    for (int i = 0; i < tmpfs_root_num; ++i) {
+        pages += tmpfs_trim_node(tmpfs_roots[i]);
+    }
+    tmpfs_unlock_irqrestore(flags);
+    return pages;
+}
+
 // Add tmpfs to filesystem list
 int register_tmpfs() {
+    tmpfs_node_cache = kmem_cache_create("tmpfs_node", sizeof(struct tmpfs_node), 0, NULL);
+    register_shrinker("tmpfs", tmpfs_shrink);
     struct filesystem* tmpfs_fs = (struct filesystem*)alloc(sizeof(struct filesystem));
     tmpfs_fs->name = "tmpfs";
     tmpfs_fs->setup_mount = tmpfs_setup_mount;
@@ -67,11 +141,11 @@ int tmpfs_setup_mount(struct filesystem* fs, struct mount* mount) {
     }
 
     mount->fs = fs;
-    mount->root = (struct vnode*)alloc(sizeof(struct vnode));
+    mount->root = (struct vnode*)kmem_cache_alloc(vnode_cache);
     if (mount->root == NULL) {
         uart_puts("tmpfs_setup_mount: Failed to allocate memory for root vnode\r\n");
         if (tmpfs_root->data) free(tmpfs_root->data); // Clean up allocated internal node data
-        free(tmpfs_root); // Clean up allocated internal node
+        kmem_cache_free(tmpfs_node_cache, tmpfs_root); // Clean up allocated internal node
         return ENOMEM_VFS;
     }
 
@@ -80,11 +154,16 @@ int tmpfs_setup_mount(struct filesystem* fs, struct mount* mount) {
     mount->root->f_ops = &tmpfs_f_ops;
     mount->root->internal = tmpfs_root;
     mount->root->parent_is_mount = 1;
-    
+    unsigned long flags = tmpfs_lock_irqsave();
+    if (tmpfs_root_num < MAX_TMPFS_MOUNTS) {
+        tmpfs_roots[tmpfs_root_num++] = tmpfs_root;
+    }
+    tmpfs_unlock_irqrestore(flags);
+
     return 0; // Success
 }
 
-int tmpfs_lookup(struct vnode* dir_node, struct vnode** target, const char* component_name) {
+static int tmpfs_lookup_locked(struct vnode* dir_node, struct vnode** target, const char* component_name) {
     if (!dir_node || !dir_node->internal || !target || !component_name) {
         return EINVAL_VFS;
     }
@@ -106,8 +185,15 @@ int tmpfs_lookup(struct vnode* dir_node, struct vnode** target, const char* comp
     return ENOENT_VFS;
 }
 
-// Common function for create and mkdir
-int tmpfs_create_or_mkdir(struct vnode* dir_node, struct vnode** target, const char* component_name, tmpfs_node_type_t type) {
+int tmpfs_lookup(struct vnode* dir_node, struct vnode** target, const char* component_name) {
+    unsigned long flags = tmpfs_lock_irqsave();
+    int ret = tmpfs_lookup_locked(dir_node, target, component_name);
+    tmpfs_unlock_irqrestore(flags);
+    return ret;
+}
+
+// Common function for create and mkdir, called with `tmpfs_lock` held
+static int tmpfs_create_or_mkdir_locked(struct vnode* dir_node, struct vnode** target, const char* component_name, tmpfs_node_type_t type) {
     if (!dir_node || !dir_node->internal || !target || !component_name || strlen(component_name) == 0) {
         return EINVAL_VFS;
     }
@@ -139,10 +225,10 @@ int tmpfs_create_or_mkdir(struct vnode* dir_node, struct vnode** target, const c
         return ENOMEM_VFS;
     }
 
-    struct vnode* new_vnode = (struct vnode*)alloc(sizeof(struct vnode));
+    struct vnode* new_vnode = (struct vnode*)kmem_cache_alloc(vnode_cache);
     if (!new_vnode) {
         if (new_internal->data) free(new_internal->data);
-        free(new_internal);
+        kmem_cache_free(tmpfs_node_cache, new_internal);
         return ENOMEM_VFS;
     }
 
@@ -159,6 +245,13 @@ int tmpfs_create_or_mkdir(struct vnode* dir_node, struct vnode** target, const c
     return 0; // Success
 }
 
+int tmpfs_create_or_mkdir(struct vnode* dir_node, struct vnode** target, const char* component_name, tmpfs_node_type_t type) {
+    unsigned long flags = tmpfs_lock_irqsave();
+    int ret = tmpfs_create_or_mkdir_locked(dir_node, target, component_name, type);
+    tmpfs_unlock_irqrestore(flags);
+    return ret;
+}
+
 int tmpfs_create(struct vnode* dir_node, struct vnode** target, const char* component_name) {
     return tmpfs_create_or_mkdir(dir_node, target, component_name, TMPFS_NODE_FILE);
 }
@@ -190,7 +283,7 @@ int tmpfs_close(struct file* file) {
     return 0;
 }
 
-int tmpfs_write(struct file* file, const void* buf, size_t len) {
+static int tmpfs_write_locked(struct file* file, const void* buf, size_t len) {
     if (!file || !file->vnode || !file->vnode->internal || !buf) {
         return EINVAL_VFS;
     }
@@ -209,12 +302,9 @@ int tmpfs_write(struct file* file, const void* buf, size_t len) {
             new_capacity *= 2; // Double the capacity
         }
         if (new_capacity > internal_node->capacity) { // only realloc if new_capacity is actually larger
-            char* new_data = (char*)alloc(new_capacity);
+            // Grows in place when the pages after the buffer are free. The shrinker may have released the buffer of an empty file
+            char* new_data = internal_node->data ? (char*)krealloc(internal_node->data, new_capacity) : tmpfs_alloc_data(new_capacity);
             if (!new_data) return ENOMEM_VFS;
-            if (internal_node->data) {
-                memcpy(new_data, internal_node->data, internal_node->size);
-                free(internal_node->data);
-            }
             internal_node->data = new_data;
             internal_node->capacity = new_capacity;
         }
@@ -228,7 +318,15 @@ int tmpfs_write(struct file* file, const void* buf, size_t len) {
     return len;
 }
 
-int tmpfs_read(struct file* file, void* buf, size_t len) {
+// Holds `tmpfs_lock` through the copy, the shrinker would free or trim the buffer under it
+int tmpfs_write(struct file* file, const void* buf, size_t len) {
+    unsigned long flags = tmpfs_lock_irqsave();
+    int ret = tmpfs_write_locked(file, buf, len);
+    tmpfs_unlock_irqrestore(flags);
+    return ret;
+}
+
+static int tmpfs_read_locked(struct file* file, void* buf, size_t len) {
     if (!file || !file->vnode || !file->vnode->internal || !buf) {
         return EINVAL_VFS;
     }
@@ -253,6 +351,13 @@ int tmpfs_read(struct file* file, void* buf, size_t len) {
     return readable_len;
 }
 
+int tmpfs_read(struct file* file, void* buf, size_t len) {
+    unsigned long flags = tmpfs_lock_irqsave();
+    int ret = tmpfs_read_locked(file, buf, len);
+    tmpfs_unlock_irqrestore(flags);
+    return ret;
+}
+
 long tmpfs_lseek64(struct file* file, long offset, int whence) {
     if (!file || !file->vnode || !file->vnode->internal) {
         return EINVAL_VFS;
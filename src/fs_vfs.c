@@ -3,11 +3,35 @@
 #define MAX_FILESYSTEMS 10
 
 struct mount* rootfs = NULL;
+struct kmem_cache* vnode_cache = NULL;
+struct kmem_cache* file_cache = NULL;
+static struct kmem_cache* mount_cache = NULL;
 static struct filesystem* filesystems[MAX_FILESYSTEMS];
 static int num_filesystems = 0;
 
+/*
+ * The namespace: the registered filesystems, the mount points and the path
+ * walks over them, from any core. Each filesystem locks its own nodes and
+ * data under it; reads and writes of open files do not take it. IRQs stay
+ * masked while it is held.
+ */
+static struct spinlock vfs_lock;
+
+static unsigned long vfs_lock_irqsave() {
+    unsigned long flags = irq_save();
+    spin_lock(&vfs_lock);
+    return flags;
+}
 
-int register_filesystem(struct filesystem* fs) {
+static void vfs_unlock_irqrestore(unsigned long flags) {
+    spin_unlock(&vfs_lock);
+    irq_restore(flags);
+}
+
+static int vfs_lookup_locked(const char* pathname, struct vnode** target);
+
+
+static int register_filesystem_locked(struct filesystem* fs) {
     if (fs == NULL || fs->name == NULL) {
       return EINVAL_VFS;
     }
@@ -23,15 +47,22 @@ int register_filesystem(struct filesystem* fs) {
     return ENOMEM_VFS;
 }
 
+int register_filesystem(struct filesystem* fs) {
+    unsigned long flags = vfs_lock_irqsave();
+    int ret = register_filesystem_locked(fs);
+    vfs_unlock_irqrestore(flags);
+    return ret;
+}
+
 // TODO: refactor
-int vfs_open(const char* pathname, int flags, struct file** target) {
+static int vfs_open_locked(const char* pathname, int flags, struct file** target) {
     if (pathname == NULL || target == NULL) {
         return EINVAL_VFS;
     }
 
     *target = NULL; // Initialize target
     struct vnode* vnode = NULL;
-    int lookup_result = vfs_lookup(pathname, &vnode);
+    int lookup_result = vfs_lookup_locked(pathname, &vnode);
     int ret;
 
     if (lookup_result != 0) {  // Not found
@@ -62,7 +93,7 @@ int vfs_open(const char* pathname, int flags, struct file** target) {
                 }
             }
             else if (last_slash_index == 0) {  // Path starts with '/', e.g., "/file.txt"
-                int ret_lookup_root = vfs_lookup("/", &parent_vnode);
+                int ret_lookup_root = vfs_lookup_locked("/", &parent_vnode);
                 if (ret_lookup_root != 0) {
                     free(path_copy_for_create);
                     return ret_lookup_root;
@@ -70,7 +101,7 @@ int vfs_open(const char* pathname, int flags, struct file** target) {
             }
             else {  // Path is like "/path/to/file" or "path/to/file"
                 path_copy_for_create[last_slash_index] = '\0';
-                ret = vfs_lookup(path_copy_for_create, &parent_vnode);
+                ret = vfs_lookup_locked(path_copy_for_create, &parent_vnode);
                 if (ret != 0) {
                     free(path_copy_for_create);
                     uart_puts("Parent directory lookup failed\n");
@@ -96,11 +127,11 @@ int vfs_open(const char* pathname, int flags, struct file** target) {
     }
 
     // Open file
-    *target = (struct file*)alloc(sizeof(struct file));
+    *target = (struct file*)kmem_cache_alloc(file_cache);
     ret = vnode->f_ops->open(vnode, target);
     if (ret != 0) {
         uart_puts("File open operation failed\n");
-        free(*target); // Clean up allocated file handle
+        kmem_cache_free(file_cache, *target); // Clean up allocated file handle
         return ret; // Return the error code from open operation
     }
     (*target)->flags = flags;
@@ -108,6 +139,14 @@ int vfs_open(const char* pathname, int flags, struct file** target) {
     return 0; // Success
 }
 
+// Holds `vfs_lock` from the lookup to the open, another core could create the same file in between
+int vfs_open(const char* pathname, int flags, struct file** target) {
+    unsigned long irq_flags = vfs_lock_irqsave();
+    int ret = vfs_open_locked(pathname, flags, target);
+    vfs_unlock_irqrestore(irq_flags);
+    return ret;
+}
+
 int vfs_close(struct file* file) {
     if (file == NULL) return EINVAL_VFS;
 
@@ -150,7 +189,7 @@ int vfs_lseek64(struct file* file, long offset, int whence) {
     return ENOSYS_VFS;
 }
 
-int vfs_mkdir(const char* pathname) {
+static int vfs_mkdir_locked(const char* pathname) {
     if (pathname == NULL) {
         return EINVAL_VFS;
     }
@@ -194,7 +233,7 @@ int vfs_mkdir(const char* pathname) {
         dir_name_to_create = path_copy;
     }
     else if (last_slash_index == 0) { // Path is like "/dirname"
-        int ret_lookup_root = vfs_lookup("/", &parent_vnode);
+        int ret_lookup_root = vfs_lookup_locked("/", &parent_vnode);
         if (ret_lookup_root != 0) {
             free(path_copy);
             return ret_lookup_root;
@@ -205,7 +244,7 @@ int vfs_mkdir(const char* pathname) {
         path_copy[last_slash_index] = '\0'; // Null-terminate parent path
         dir_name_to_create = path_copy + last_slash_index + 1;
 
-        int ret_lookup = vfs_lookup(path_copy, &parent_vnode);
+        int ret_lookup = vfs_lookup_locked(path_copy, &parent_vnode);
         if (ret_lookup != 0) {
             free(path_copy); 
             return ret_lookup; 
@@ -243,13 +282,20 @@ int vfs_mkdir(const char* pathname) {
     }
 }
 
-int vfs_mknod(const char* pathname, struct file_operations* f_ops) {
+int vfs_mkdir(const char* pathname) {
+    unsigned long flags = vfs_lock_irqsave();
+    int ret = vfs_mkdir_locked(pathname);
+    vfs_unlock_irqrestore(flags);
+    return ret;
+}
+
+static int vfs_mknod_locked(const char* pathname, struct file_operations* f_ops) {
     if (pathname == NULL) {
         return EINVAL_VFS;
     }
 
     struct file *dev = NULL;
-    int ret = vfs_open(pathname, O_CREAT, &dev);
+    int ret = vfs_open_locked(pathname, O_CREAT, &dev);
     if (ret != 0) {
         uart_puts("[vfs_mknod] vfs_open failed: ");
         uart_puts(pathname);
@@ -269,8 +315,15 @@ int vfs_mknod(const char* pathname, struct file_operations* f_ops) {
     return 0;
 }
 
+int vfs_mknod(const char* pathname, struct file_operations* f_ops) {
+    unsigned long flags = vfs_lock_irqsave();
+    int ret = vfs_mknod_locked(pathname, f_ops);
+    vfs_unlock_irqrestore(flags);
+    return ret;
+}
+
 // Mount a filesystem at a target path, handle the operation before entering the mount point
-int vfs_mount(const char* target_pathname, const char* filesystem_name) {
+static int vfs_mount_locked(const char* target_pathname, const char* filesystem_name) {
     if (target_pathname == NULL || filesystem_name == NULL) {
         return EINVAL_VFS;
     }
@@ -292,7 +345,7 @@ int vfs_mount(const char* target_pathname, const char* filesystem_name) {
 
     // Check if the target path exists and is a valid mount point
     struct vnode* target_vnode = NULL;
-    int lookup_result = vfs_lookup(target_pathname, &target_vnode);
+    int lookup_result = vfs_lookup_locked(target_pathname, &target_vnode);
     if (lookup_result != 0) {
         return lookup_result;
     }
@@ -310,7 +363,7 @@ int vfs_mount(const char* target_pathname, const char* filesystem_name) {
     }
 
     // Create a new mount point structure
-    struct mount* new_mount = (struct mount*)alloc(sizeof(struct mount));
+    struct mount* new_mount = (struct mount*)kmem_cache_alloc(mount_cache);
     if (new_mount == NULL) {
         return ENOMEM_VFS;
     }
@@ -321,7 +374,7 @@ int vfs_mount(const char* target_pathname, const char* filesystem_name) {
 
     // Call the filesystem's setup_mount function
     if (fs_to_mount->setup_mount == NULL) {
-        free(new_mount);
+        kmem_cache_free(mount_cache, new_mount);
         uart_puts("Filesystem does not support mounting: ");
         uart_puts(filesystem_name);
         uart_puts("\r\n");
@@ -330,7 +383,7 @@ int vfs_mount(const char* target_pathname, const char* filesystem_name) {
     int setup_result = fs_to_mount->setup_mount(fs_to_mount, new_mount);
     if (setup_result != 0) {
         target_vnode->mount = NULL; 
-        free(new_mount);
+        kmem_cache_free(mount_cache, new_mount);
         uart_puts("[vfs_mount] Filesystem setup_mount failed for: ");
         uart_puts(filesystem_name);
         uart_puts("\r\n");
@@ -342,6 +395,14 @@ int vfs_mount(const char* target_pathname, const char* filesystem_name) {
     return 0;  // Success
 }
 
+// Under `vfs_lock`: a lookup on another core would follow `mount` before `setup_mount` set its root
+int vfs_mount(const char* target_pathname, const char* filesystem_name) {
+    unsigned long flags = vfs_lock_irqsave();
+    int ret = vfs_mount_locked(target_pathname, filesystem_name);
+    vfs_unlock_irqrestore(flags);
+    return ret;
+}
+
 // Get the next component from a path
 // @note This function will modify `path_ptr`
 static char* get_next_component(char** path_ptr) {
@@ -374,7 +435,7 @@ static char* get_next_component(char** path_ptr) {
     return component;
 }
 
-int vfs_lookup(const char* pathname, struct vnode** target) {
+static int vfs_lookup_locked(const char* pathname, struct vnode** target) {
     // uart_puts("[vfs_lookup] Looking up path: ");
     // uart_puts(pathname);
     // uart_puts("\r\n");
@@ -491,11 +552,22 @@ int vfs_lookup(const char* pathname, struct vnode** target) {
     return 0; // Success
 }
 
+int vfs_lookup(const char* pathname, struct vnode** target) {
+    unsigned long flags = vfs_lock_irqsave();
+    int ret = vfs_lookup_locked(pathname, target);
+    vfs_unlock_irqrestore(flags);
+    return ret;
+}
+
 void vfs_init() {
     uart_puts("Initializing VFS...\n");
+    vnode_cache = kmem_cache_create("vnode", sizeof(struct vnode), 0, NULL);
+    file_cache = kmem_cache_create("file", sizeof(struct file), 0, NULL);
+    mount_cache = kmem_cache_create("mount", sizeof(struct mount), 0, NULL);
+
     // root FS
     register_tmpfs();
-    rootfs = (struct mount*)alloc(sizeof(struct mount));
+    rootfs = (struct mount*)kmem_cache_alloc(mount_cache);
     if (rootfs == NULL) {
         uart_puts("Failed to allocate memory for root filesystem mount\n");
         return;
@@ -515,4 +587,8 @@ void vfs_init() {
     vfs_mkdir("/dev");
     vfs_mknod("/dev/uart", &uart_f_ops);
     vfs_mknod("/dev/framebuffer", &framebuffer_f_ops);
+
+    uart_puts("Initializing /proc...\n");
+    vfs_mkdir("/proc");
+    vfs_mknod("/proc/meminfo", &meminfo_f_ops);
 }
@@ -1,4 +1,9 @@
 #include "mailbox.h"
+#include "mmu.h"
+#include "smp.h"
+
+// One request in flight: a core could otherwise read the response to the request of another
+static struct spinlock mailbox_lock;
 
 unsigned int mailbox_call(volatile unsigned int *mbox, unsigned char channel) {
     uart_puts("[mailbox_call] called with channel: ");
@@ -8,11 +13,18 @@ unsigned int mailbox_call(volatile unsigned int *mbox, unsigned char channel) {
     uart_puts("\r\n");
     
     unsigned int msg = ((unsigned int)((unsigned long)mbox) & ~0xF) | (channel & 0xF);
+    unsigned int mbox_size = mbox[0];
+    dcache_clean_invalidate_range((void*)mbox, mbox_size);  // Let the GPU see the request
+    unsigned long flags = irq_save();
+    spin_lock(&mailbox_lock);
     do { asm volatile("nop"); } while (*MAILBOX_STATUS & MAILBOX_FULL);
     *MAILBOX_WRITE = msg;
 
     do { asm volatile("nop");  } while (*MAILBOX_STATUS & MAILBOX_EMPTY);
     unsigned int res = *MAILBOX_READ;
+    spin_unlock(&mailbox_lock);
+    irq_restore(flags);
+    dcache_clean_invalidate_range((void*)mbox, mbox_size);  // Drop stale lines before reading the response
 
     if (msg == res) {
         if (mbox[1] & REQUEST_SUCCEED) {
@@ -31,4 +43,29 @@ unsigned int mailbox_call(volatile unsigned int *mbox, unsigned char channel) {
         uart_puts("\r\n");
         return 0;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * mailbox_get_arm_memory - Query the memory range the firmware gives to the ARM
+ *
+ * @param base: Set to the base address of the ARM memory
+ * @param size: Set to the size of the ARM memory in bytes
+ * @return 1 for success, 0 for failure
+ */
+unsigned int mailbox_get_arm_memory(unsigned int *base, unsigned int *size) {
+    volatile unsigned int __attribute__((aligned(16))) mbox[8];
+
+    mbox[0] = 8 * 4;
+    mbox[1] = REQUEST_CODE;
+    mbox[2] = GET_ARM_MEMORY;
+    mbox[3] = 8;
+    mbox[4] = TAG_REQUEST_CODE;
+    mbox[5] = 0; // base address
+    mbox[6] = 0; // size
+    mbox[7] = END_TAG;
+
+    if (!mailbox_call(mbox, MBOX_CH_PROP)) return 0;
+    *base = mbox[5];
+    *size = mbox[6];
+    return 1;
+}
@@ -8,12 +8,19 @@
 #include "syscall.h"
 #include "exec.h"
 #include "fs_vfs.h"
+#include "mailbox.h"
+#include "contig.h"
+#include "smp.h"
 
 extern char *__stack_top;
 extern uint32_t cpio_addr;
 extern uint32_t cpio_end;
 extern uint32_t fdt_total_size;
 
+static void reserve_fdt_region(uint64_t address, uint64_t size) {
+    memblock_reserve(address, size);
+}
+
 void foo(){
     for(int i = 0; i < 10; ++i) {
         unsigned int thread_id = ((struct ThreadTask *)get_current())->id;
@@ -127,6 +134,8 @@ void test_syscall() {
 
     /******** Fork ********/
     struct ThreadTask* new_thread = thread_create(fork_test);
+    sched_dequeue(new_thread);
+    new_thread->state = TASK_RUNNING;
 
     asm volatile(
         "msr tpidr_el1, %0\n"
@@ -146,6 +155,8 @@ void test_syscall() {
 // Create a shell thread that run in EL0
 void create_shell_thread() {
     struct ThreadTask* new_thread = thread_create(shell);
+    sched_dequeue(new_thread);  // Runs now, it is queued again when it is switched out
+    new_thread->state = TASK_RUNNING;
     asm volatile(
         "msr tpidr_el1, %0\n"
         "mov x5, 0x0\n"
@@ -485,11 +496,29 @@ void main() {
         return;
     }
 
+    // Discover the physical memory: devicetree first, the firmware as fallback
+    fdt_traverse(memory_callback);
+    unsigned long mem_base = fdt_memory_base, mem_size = fdt_memory_size;
+    if (mem_size == 0) {
+        unsigned int mbox_base, mbox_size;
+        if (!mailbox_get_arm_memory(&mbox_base, &mbox_size)) {
+            uart_puts("Failed to discover the physical memory!\n");
+            return;
+        }
+        mem_base = mbox_base;
+        mem_size = mbox_size;
+    }
+
+    // Boot memory map, the buddy free lists are built from it in one pass
+    memblock_add(mem_base, mem_size);
+    memblock_reserve(0x0000, 0x1000);                                           // Spin tables for multicore boot
+    memblock_reserve(0x80000, (unsigned long)&__stack_top - 0x80000);          // Kernel image & startup allocator
+    memblock_reserve(cpio_addr, cpio_end - cpio_addr);                          // Initramfs
+    memblock_reserve(dtb_address, be2le_u32(fdt_total_size));                  // Devicetree
+    fdt_traverse_rsvmap(reserve_fdt_region);                                    // Memory reservation block
+    fdt_traverse(bootargs_callback);
+    contig_init(contig_parse_size(fdt_bootargs));                               // Region for allocations above MAX_ALLOC_SIZE
     mm_init();
-    reserve(0x0000, 0x1000);                                    // Spin tables for multicore boot
-    reserve(0x80000, (void*)&__stack_top);                      // Kernel image & startup allocator
-    reserve((void*)cpio_addr, (void*)cpio_end);                 // Initramfs
-    reserve((void*)dtb_address, (void*)dtb_address + be2le_u32(fdt_total_size));   // Devicetree 
 
     kmem_cache_init();
 
@@ -501,6 +530,8 @@ void main() {
 
     timer_init();
 
+    smp_init();
+
     // run_tmpfs_test_suite();
     // run_mount_tests();
 
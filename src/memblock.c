@@ -0,0 +1,145 @@
+#include "memblock.h"
+#include "mm.h"
+
+/*
+ * Boot memory map.
+ *
+ * Before the page allocator exists, `main()` registers the physical memory
+ * (`memblock_add`) and every range that must never be handed out
+ * (`memblock_reserve`): the spin tables, the kernel image, the initramfs, the
+ * devicetree... `mm_init` then walks memory minus reserved once with
+ * `memblock_next_free` and puts each free range in the buddy free lists.
+ */
+static struct MemBlockType memblock_memory;
+static struct MemBlockType memblock_reserved;
+
+// Insert [start, end) keeping the list sorted, merging with overlapping or adjacent regions
+static int memblock_insert(struct MemBlockType *type, unsigned long start, unsigned long end) {
+    if (end <= start) return 0;
+
+    // First region that may be merged, all the regions before it end before `start`
+    int first = 0;
+    while (first < type->cnt && type->regions[first].end < start) {
+        first++;
+    }
+
+    // Regions [first, last) touch [start, end)
+    int last = first;
+    while (last < type->cnt && type->regions[last].start <= end) {
+        if (type->regions[last].start < start) start = type->regions[last].start;
+        if (type->regions[last].end > end) end = type->regions[last].end;
+        last++;
+    }
+
+    if (first == last && type->cnt >= MEMBLOCK_MAX_REGIONS) {
+        uart_puts("memblock: too many regions!\r\n");
+        return -1;
+    }
+
+    // Replace regions [first, last) with the merged one
+    int shift = 1 - (last - first);
+    if (shift > 0) {
+        for (int i = type->cnt - 1; i >= last; i--) type->regions[i + shift] = type->regions[i];
+    }
+    else if (shift < 0) {
+        for (int i = last; i < type->cnt; i++) type->regions[i + shift] = type->regions[i];
+    }
+    type->cnt += shift;
+    type->regions[first].start = start;
+    type->regions[first].end = end;
+    return 0;
+}
+
+// Register a range of physical memory
+int memblock_add(unsigned long base, unsigned long size) {
+    return memblock_insert(&memblock_memory, base, base + size);
+}
+
+// Keep a range out of the free lists built by `mm_init`
+int memblock_reserve(unsigned long base, unsigned long size) {
+    return memblock_insert(&memblock_reserved, base, base + size);
+}
+
+/**
+ * memblock_next_free - Find the next free range of the boot memory map
+ *
+ * Free ranges are memory minus reserved, shrunk to page boundaries, in
+ * increasing address order.
+ *
+ * @param cursor: Address to search from, set to 0 for the first call. Updated
+ *                past the returned range.
+ * @param out: The free range found
+ * @return 1 if a range was found, 0 when there is none left
+ */
+int memblock_next_free(unsigned long *cursor, struct MemRegion *out) {
+    for (int i = 0; i < memblock_memory.cnt; i++) {
+        struct MemRegion *mem = &memblock_memory.regions[i];
+        unsigned long start = mem->start > *cursor ? mem->start : *cursor;
+
+        while (start < mem->end) {
+            unsigned long end = mem->end;
+            for (int j = 0; j < memblock_reserved.cnt; j++) {
+                struct MemRegion *rsv = &memblock_reserved.regions[j];
+                if (rsv->end <= start) continue;
+                if (rsv->start <= start) {  // `start` is reserved, skip the region
+                    start = rsv->end;
+                    continue;
+                }
+                if (rsv->start < end) end = rsv->start;
+                break;
+            }
+            if (start >= end) break;
+
+            unsigned long page_start = PAGE_ALIGN(start);
+            unsigned long page_end = end & ~(unsigned long)(PAGE_SIZE - 1);
+            if (page_start < page_end) {
+                out->start = page_start;
+                out->end = page_end;
+                *cursor = end;
+                return 1;
+            }
+            start = end;  // Less than a page between two reservations
+        }
+    }
+    return 0;
+}
+
+// Allocate from the first free range that fits, the result is reserved
+void* memblock_alloc(unsigned long size, unsigned long align) {
+    struct MemRegion range;
+    unsigned long cursor = 0;
+    while (memblock_next_free(&cursor, &range)) {
+        unsigned long addr = (range.start + align - 1) & ~(align - 1);
+        if (addr + size <= range.end) {
+            if (memblock_reserve(addr, size)) return NULL;
+            return (void*)addr;
+        }
+    }
+    return NULL;
+}
+
+unsigned long memblock_start() {
+    return memblock_memory.cnt ? memblock_memory.regions[0].start : 0;
+}
+
+unsigned long memblock_end() {
+    return memblock_memory.cnt ? memblock_memory.regions[memblock_memory.cnt - 1].end : 0;
+}
+
+static void memblock_dump_type(char *name, struct MemBlockType *type) {
+    for (int i = 0; i < type->cnt; i++) {
+        uart_puts(name);
+        uart_puts("[");
+        uart_puts(itoa(i));
+        uart_puts("]: ");
+        uart_hex(type->regions[i].start);
+        uart_puts(" - ");
+        uart_hex(type->regions[i].end);
+        uart_puts("\r\n");
+    }
+}
+
+void memblock_dump() {
+    memblock_dump_type("memory", &memblock_memory);
+    memblock_dump_type("reserved", &memblock_reserved);
+}
@@ -0,0 +1,246 @@
+#include "meminfo.h"
+#include "contig.h"
+
+/*
+ * Allocator report, printed by the `meminfo` shell command and readable from
+ * `/proc/meminfo`. The report is built from the always-on counters of the
+ * page allocator and the kmem caches, it never walks the free lists.
+ */
+
+struct file_operations meminfo_f_ops = {
+    .open = meminfo_open,
+    .close = meminfo_close,
+    .write = meminfo_write,
+    .read = meminfo_read,
+    .lseek64 = meminfo_lseek64,
+};
+
+// Bounded output buffer, the report is cut when it is full
+struct ReportBuf {
+    char *buf;
+    int len;
+    int size;
+};
+
+static void report_puts(struct ReportBuf *rb, const char *s) {
+    while (*s && rb->len < rb->size - 1) {
+        rb->buf[rb->len++] = *s++;
+    }
+    rb->buf[rb->len] = '\0';
+}
+
+static void report_num(struct ReportBuf *rb, unsigned long num) {
+    char tmp[21];
+    int i = sizeof(tmp) - 1;
+    tmp[i] = '\0';
+    do {
+        tmp[--i] = '0' + num % 10;
+        num /= 10;
+    } while (num);
+    report_puts(rb, tmp + i);
+}
+
+static void report_kv(struct ReportBuf *rb, const char *key, unsigned long value, const char *unit) {
+    report_puts(rb, key);
+    report_puts(rb, ": ");
+    report_num(rb, value);
+    report_puts(rb, unit);
+    report_puts(rb, "\r\n");
+}
+
+/**
+ * meminfo_report - Write the allocator report into a buffer
+ *
+ * @param buf: The output buffer, always NUL-terminated
+ * @param size: Size of the buffer
+ * @return The length of the report
+ */
+int meminfo_report(char *buf, int size) {
+    struct ReportBuf rb = { buf, 0, size };
+    if (size <= 0) return 0;
+    buf[0] = '\0';
+
+    report_kv(&rb, "MemTotal", (unsigned long)page_num * PAGE_SIZE / 1024, " kB");
+    report_kv(&rb, "MemFree", mm_free_pages() * PAGE_SIZE / 1024, " kB");
+    report_kv(&rb, "PageCached", (unsigned long)pcp_cached_pages() * PAGE_SIZE / 1024, " kB");
+    report_kv(&rb, "ZeroPool", (unsigned long)zero_pool_pages() * PAGE_SIZE / 1024, " kB");
+    report_kv(&rb, "StackPool", (unsigned long)stack_pool_count() * THREAD_STACK_SIZE / 1024, " kB");
+
+    int contig_total, contig_used;
+    contig_usage(&contig_total, &contig_used);
+    report_kv(&rb, "ContigTotal", (unsigned long)contig_total * PAGE_SIZE / 1024, " kB");
+    report_kv(&rb, "ContigUsed", (unsigned long)contig_used * PAGE_SIZE / 1024, " kB");
+
+    report_kv(&rb, "AllocFail", mm_stats.alloc_fail_cnt, "");
+    report_kv(&rb, "Split", mm_stats.split_cnt, "");
+    report_kv(&rb, "Merge", mm_stats.merge_cnt, "");
+    report_kv(&rb, "GrowInPlace", mm_stats.grow_cnt, "");
+    report_kv(&rb, "PcpHit", mm_stats.pcp_hit_cnt, "");
+    report_kv(&rb, "ZeroHit", mm_stats.zero_hit_cnt, "");
+    report_kv(&rb, "ZeroMiss", mm_stats.zero_miss_cnt, "");
+    report_kv(&rb, "Pressure", mm_stats.pressure_cnt, "");
+    report_puts(&rb, "Watermark: ");
+    report_puts(&rb, wmark_name(mm_watermark()));
+    report_puts(&rb, "\r\n");
+    report_kv(&rb, "WmarkLow", wmark_pages(WMARK_LOW) * PAGE_SIZE / 1024, " kB");
+    report_kv(&rb, "WmarkCritical", wmark_pages(WMARK_CRITICAL) * PAGE_SIZE / 1024, " kB");
+    report_kv(&rb, "BelowLow", mm_stats.wmark_low_cnt, "");
+    report_kv(&rb, "BelowCritical", mm_stats.wmark_critical_cnt, "");
+    report_kv(&rb, "Reclaim", mm_stats.reclaim_cnt, "");
+    report_kv(&rb, "StackHit", stack_stats.hit_cnt, "");
+    report_kv(&rb, "StackMiss", stack_stats.miss_cnt, "");
+    report_kv(&rb, "StackMaxDepth", stack_stats.max_depth, " B");
+
+    // order  free  alloc  free'd  unusable free space index (permille)
+    report_puts(&rb, "\r\norder free_blocks allocs frees frag_index\r\n");
+    for (int i = 0; i < MAX_ORDER; i++) {
+        report_num(&rb, i);
+        report_puts(&rb, " ");
+        report_num(&rb, mm_stats.free_blocks[i]);
+        report_puts(&rb, " ");
+        report_num(&rb, mm_stats.alloc_cnt[i]);
+        report_puts(&rb, " ");
+        report_num(&rb, mm_stats.free_cnt[i]);
+        report_puts(&rb, " ");
+        report_num(&rb, mm_frag_index(i));
+        report_puts(&rb, "\r\n");
+    }
+
+    report_puts(&rb, "\r\nclass pageblocks fallbacks claimed\r\n");
+    for (int c = 0; c < ALLOC_CLASSES; c++) {
+        report_puts(&rb, alloc_class_name(c));
+        report_puts(&rb, " ");
+        report_num(&rb, pageblock_count(c));
+        report_puts(&rb, " ");
+        report_num(&rb, mm_stats.fallback_cnt[c]);
+        report_puts(&rb, " ");
+        report_num(&rb, mm_stats.pageblock_claim_cnt[c]);
+        report_puts(&rb, "\r\n");
+    }
+
+    report_puts(&rb, "\r\nshrinker calls freed_pages\r\n");
+    for (int i = 0; i < shrinker_count(); i++) {
+        const struct Shrinker *shrinker = shrinker_get(i);
+        report_puts(&rb, shrinker->name);
+        report_puts(&rb, " ");
+        report_num(&rb, shrinker->call_cnt);
+        report_puts(&rb, " ");
+        report_num(&rb, shrinker->freed_pages);
+        report_puts(&rb, "\r\n");
+    }
+
+    // in_use: objects handed out, magazined: free objects held by the magazines and the depot
+    report_puts(&rb, "\r\ncache pages empty_slabs in_use magazined allocs frees fails\r\n");
+    for (int i = 0; i < CACHE_NUM + kmem_slab_cache_num; i++) {
+        struct kmem_cache *cache = i < CACHE_NUM ? &kmem_caches[i] : &kmem_slab_caches[i - CACHE_NUM];
+        unsigned long alloc_cnt, free_cnt;
+        kmem_cache_counts(cache, &alloc_cnt, &free_cnt);
+        report_puts(&rb, cache->name);
+        report_puts(&rb, "-");
+        report_num(&rb, cache->cache_size);
+        report_puts(&rb, " ");
+        report_num(&rb, cache->pages);
+        report_puts(&rb, " ");
+        report_num(&rb, cache->empty_cnt);
+        report_puts(&rb, " ");
+        report_num(&rb, alloc_cnt - free_cnt);
+        report_puts(&rb, " ");
+        report_num(&rb, cache->in_use - (alloc_cnt - free_cnt));
+        report_puts(&rb, " ");
+        report_num(&rb, alloc_cnt);
+        report_puts(&rb, " ");
+        report_num(&rb, free_cnt);
+        report_puts(&rb, " ");
+        report_num(&rb, cache->fail_cnt);
+        report_puts(&rb, "\r\n");
+    }
+    return rb.len;
+}
+
+void print_meminfo() {
+    char *buf = alloc(MEMINFO_BUF_SIZE);
+    if (buf == NULL) return;
+    meminfo_report(buf, MEMINFO_BUF_SIZE);
+    uart_puts(buf);
+    free(buf);
+}
+
+int meminfo_open(struct vnode* file_node, struct file** target) {
+    if (file_node == NULL || target == NULL) {
+        return EINVAL_VFS;
+    }
+
+    *target = (struct file*)kmem_cache_alloc(file_cache);
+    if (*target == NULL) {
+        return ENOMEM_VFS;
+    }
+
+    (*target)->vnode = file_node;
+    (*target)->f_pos = 0;
+    (*target)->f_ops = &meminfo_f_ops;
+    return 0;
+}
+
+int meminfo_close(struct file* file) {
+    if (file == NULL) {
+        return EINVAL_VFS;
+    }
+
+    kmem_cache_free(file_cache, file);
+    return 0;
+}
+
+int meminfo_write(struct file* file, const void* buf, size_t len) {
+    return EACCES_VFS;  // Read-only
+}
+
+// The report is rebuilt on every read, so a reader sees a fresh snapshot from its position
+int meminfo_read(struct file* file, void* buf, size_t len) {
+    if (file == NULL || buf == NULL) {
+        return EINVAL_VFS;
+    }
+
+    char *report = alloc(MEMINFO_BUF_SIZE);
+    if (report == NULL) {
+        return ENOMEM_VFS;
+    }
+    size_t report_len = meminfo_report(report, MEMINFO_BUF_SIZE);
+
+    size_t n = 0;
+    if (file->f_pos < report_len) {
+        n = report_len - file->f_pos;
+        if (n > len) n = len;
+        memcpy(buf, report + file->f_pos, n);
+        file->f_pos += n;
+    }
+    free(report);
+    return n;
+}
+
+long meminfo_lseek64(struct file* file, long offset, int whence) {
+    if (file == NULL) {
+        return EINVAL_VFS;
+    }
+
+    long new_pos = file->f_pos;
+    switch (whence) {
+        case SEEK_SET:
+            new_pos = offset;
+            break;
+        case SEEK_CUR:
+            new_pos += offset;
+            break;
+        case SEEK_END:
+            new_pos = MEMINFO_BUF_SIZE + offset;  // The report length changes with each snapshot
+            break;
+        default:
+            return EINVAL_VFS;
+    }
+
+    if (new_pos < 0) {
+        return EINVAL_VFS;
+    }
+
+    file->f_pos = new_pos;
+    return new_pos;
+}
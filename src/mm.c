@@ -1,9 +1,55 @@
 #include "mm.h"
 
-struct PageInfo *free_list[MAX_ORDER];  // An array of double linked lists, where each index corresponds to a different order of blocks
-struct PageInfo page_list[PAGE_NUM]; // Array to store the status of each page
+struct FreeBlock *free_list[MAX_ORDER][ALLOC_CLASSES];  // Double linked lists of free blocks, per order and per lifetime class
+uint8_t *page_meta = NULL;  // Order and flags of each page, see `PAGE_*` in mm.h. Carved from RAM by `mm_init`
+static uint8_t *pageblock_class = NULL;  // `ALLOC_*` class owning each pageblock, carved with the page metadata
+
+// free_map[order] has one bit per block of that order, set if the block is in the free list
+static uint64_t *free_map[MAX_ORDER];
+static int mm_ready = 0;
+
+static struct PageCache pcp[PCP_ORDERS][ALLOC_CLASSES];
+
+// Free lists, hot page caches and zeroed pool are shared by the cores. The
+// lock is dropped before the shrinkers run, they free pages themselves.
+static struct spinlock zone_lock;
+static struct spinlock shrink_lock;  // One core runs the shrinkers at a time
+
+// Zeroed order 0 pages, allocated from the buddy lists but not handed out yet.
+// Kept in an array rather than linked through the pages so that they stay all zero.
+static void *zero_pool[ZERO_POOL_HIGH];
+static int zero_pool_cnt = 0;
+
+// Called in registration order when an allocation is about to fail
+static struct Shrinker shrinkers[MAX_SHRINKERS];
+static int shrinker_num = 0;
+
+static int wmark_level = WMARK_OK;          // Last level seen by `mm_watermark`
+static unsigned long reclaim_mark = 0;      // Available pages left by the last background reclaim
+
+// Where each class goes when its own free lists are empty
+static const int class_fallbacks[ALLOC_CLASSES][ALLOC_CLASSES - 1] = {
+    [ALLOC_UNMOVABLE]   = { ALLOC_RECLAIMABLE, ALLOC_TEMPORARY },
+    [ALLOC_RECLAIMABLE] = { ALLOC_UNMOVABLE, ALLOC_TEMPORARY },
+    [ALLOC_TEMPORARY]   = { ALLOC_RECLAIMABLE, ALLOC_UNMOVABLE },
+};
+static const char *class_names[ALLOC_CLASSES] = { "unmovable", "reclaimable", "temporary" };
+
+struct MemStats mm_stats;
 
 void *memory_start = NULL;
+int page_num = 0;  // Number of pages managed by the buddy system
+
+static inline unsigned long zone_lock_irqsave() {
+    unsigned long flags = irq_save();
+    spin_lock(&zone_lock);
+    return flags;
+}
+
+static inline void zone_unlock_irqrestore(unsigned long flags) {
+    spin_unlock(&zone_lock);
+    irq_restore(flags);
+}
 
 // Round up to the multiple of `PAGE_SIZE`
 int round(int size) {
@@ -27,6 +73,50 @@ int get_buddy(int idx, int order) {
     return idx ^ (1 << order);
 }
 
+static inline int test_free(int idx, int order) {
+    int bit = idx >> order;
+    return (free_map[order][bit >> 6] >> (bit & 63)) & 1;
+}
+
+static inline void set_free(int idx, int order) {
+    int bit = idx >> order;
+    free_map[order][bit >> 6] |= (1UL << (bit & 63));
+}
+
+static inline void clear_free(int idx, int order) {
+    int bit = idx >> order;
+    free_map[order][bit >> 6] &= ~(1UL << (bit & 63));
+}
+
+static inline struct FreeBlock* idx_to_block(int idx) {
+    return (struct FreeBlock*)(memory_start + (unsigned long)idx * PAGE_SIZE);
+}
+
+static inline int block_to_idx(struct FreeBlock *block) {
+    return ((void*)block - memory_start) / PAGE_SIZE;
+}
+
+// Mark the page `pos` pages after the start of a slab
+void set_page_slab(int idx, int pos) {
+    page_meta[idx] = PAGE_SLAB | pos;
+}
+
+int page_is_slab(int idx) {
+    return (page_meta[idx] & ~PAGE_ORDER_MASK) == PAGE_SLAB;
+}
+
+int get_slab_page_pos(int idx) {
+    return page_meta[idx] & PAGE_ORDER_MASK;
+}
+
+// Turn a slab of `1 << order` pages back into an allocated block, ready for `_free`
+void clear_page_slab(int idx, int order) {
+    page_meta[idx] = PAGE_ALLOCATED | order;
+    for (int i = 1; i < (1 << order); i++) {
+        page_meta[idx + i] = 0;
+    }
+}
+
 int get_lsb(int x) {
     int lsb = 0;
     while (x > 1) {
@@ -87,16 +177,18 @@ void print_free_page_msg(void* addr, int idx, int curr_idx, int order) {
 void print_free_list() {
     uart_puts("========== Free List ==========\n");
     for (int i = 0; i < MAX_ORDER; i++) {
-        struct PageInfo *entry = free_list[i];
         int cnt = 0;
         uart_puts("Order ");
         uart_puts(itoa(i));
         uart_puts(": ");
-        while (entry != NULL) {
-            cnt++;
-            uart_puts(itoa(entry->idx));
-            uart_puts(" -> ");
-            entry = entry->next;
+        for (int c = 0; c < ALLOC_CLASSES; c++) {
+            struct FreeBlock *entry = free_list[i][c];
+            while (entry != NULL) {
+                cnt++;
+                uart_puts(itoa(block_to_idx(entry)));
+                uart_puts(" -> ");
+                entry = entry->next;
+            }
         }
         uart_puts("NULL\t[");
         uart_puts(itoa(cnt));
@@ -105,71 +197,654 @@ void print_free_list() {
     uart_puts("===============================\r\n\r\n");
 }
 
-// Add the entry to the front of the free list for the given order
-void add_to_free_list(struct PageInfo *entry, int order) {
-    if (entry == NULL || order < 0 || order >= MAX_ORDER) return;
-    if (free_list[order] == NULL) {
-        free_list[order] = entry;
-        entry->next = NULL;
-        entry->prev = NULL;
-    }
-    else {
-        free_list[order]->prev = entry;
-        entry->prev = NULL;
-        entry->next = free_list[order];
-        free_list[order] = entry;
+// Add the block to the front of the free list for the given order, in the class of its pageblock
+void add_to_free_list(int idx, int order) {
+    if (idx < 0 || idx >= page_num || order < 0 || order >= MAX_ORDER) return;
+    set_free(idx, order);
+
+    int class = pageblock_class[idx >> PAGEBLOCK_ORDER];
+    page_meta[idx] = class;  // Remember the list, the pageblock may change class while the block is free
+    mm_stats.free_blocks[order]++;
+
+    struct FreeBlock *entry = idx_to_block(idx);
+    entry->prev = NULL;
+    entry->next = free_list[order][class];
+    if (free_list[order][class] != NULL) {
+        free_list[order][class]->prev = entry;
     }
+    free_list[order][class] = entry;
 
-    // print_add_msg(entry->idx, order);
+    // print_add_msg(idx, order);
 }
 
-void rm_from_free_list(struct PageInfo *entry, int order) {
-    if (entry == NULL || order < 0 || order >= MAX_ORDER) return;
-    if (free_list[order] == entry) {  // At the front
-        free_list[order] = entry->next;
-        if (entry->next != NULL) {
-            entry->next->prev = NULL;
-        }
+void rm_from_free_list(int idx, int order) {
+    if (idx < 0 || idx >= page_num || order < 0 || order >= MAX_ORDER) return;
+    clear_free(idx, order);
+
+    int class = page_meta[idx] & PAGE_CLASS_MASK;
+    mm_stats.free_blocks[order]--;
+    struct FreeBlock *entry = idx_to_block(idx);
+    if (free_list[order][class] == entry) {  // At the front
+        free_list[order][class] = entry->next;
+    }
+    else if (entry->prev != NULL) {  // In the middle
+        entry->prev->next = entry->next;
     }
-    else {  // In the middle
-        if (entry->prev != NULL) entry->prev->next = entry->next;
-        if (entry->next != NULL) entry->next->prev = entry->prev;
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
     }
 
-    entry->next = NULL;
-    entry->prev = NULL;
-    // simple_free(buddy_entry);  // TODO: Maybe used a circular linked list to do simple_alloc and simple_free
+    // print_rm_msg(idx, order);
+}
 
-    // print_rm_msg(entry->idx, order);
+// Free [start_idx, end_idx) with the largest aligned blocks that fit
+static void add_free_range(int start_idx, int end_idx) {
+    int idx = start_idx;
+    while (idx < end_idx) {
+        int order = MAX_ORDER - 1;
+        while (order > 0 && ((idx & ((1 << order) - 1)) || idx + (1 << order) > end_idx)) {
+            order--;
+        }
+        add_to_free_list(idx, order);
+        idx += (1 << order);
+    }
 }
 
+static void reserve_pages(void *start, void *end);
+static void pcp_init();
+
+/**
+ * mm_init - Initialize the page allocator from the boot memory map
+ *
+ * The page metadata (order/flags bytes and the per-order free bitmaps) is
+ * sized from the span of the memory registered with `memblock_add` and carved
+ * from it with `memblock_alloc`. The free lists are then populated in a
+ * single pass over memory minus reserved, each free range being cut into the
+ * largest aligned blocks that fit, so no block is ever split or removed
+ * while booting. Holes between memory regions are never freed.
+ */
 void mm_init() {
     // Initialize the free list
     for (int i = 0; i < MAX_ORDER; i++) {
-        free_list[i] = NULL;
+        for (int c = 0; c < ALLOC_CLASSES; c++) {
+            free_list[i][c] = NULL;
+        }
     }
+    pcp_init();
 
-    // Allocate the frame array
-    memory_start = 0x00000000;  // TODO: For testing
-    memset(page_list, 0, sizeof(page_list));
+    unsigned long mem_start = PAGE_ALIGN(memblock_start());
+    unsigned long mem_end = memblock_end() & ~(unsigned long)(PAGE_SIZE - 1);
+    if (mem_end <= mem_start) {
+        uart_puts("No memory registered!\r\n");
+        return;
+    }
+    memory_start = (void*)mem_start;
+    page_num = (mem_end - mem_start) / PAGE_SIZE;
 
-    // Initialize the free list and page list
-    for (int i=0; i<PAGE_NUM; i+=MAX_BLOCK_SIZE) {
-        struct PageInfo *entry = page_list + i;
-        entry->idx = i;
-        add_to_free_list(entry, MAX_ORDER - 1);  // Add to the free list with the maximum order
-        
-        page_list[i].order = MAX_ORDER - 1;
-        // page_list[i].allocated = 0;  // Mark as free
-        page_list[i].entry_in_list = entry;  // Link to the free list entry
+    // Carve the metadata from free memory
+    unsigned long map_size = FREE_MAP_WORDS(page_num) * sizeof(uint64_t);
+    int pageblock_num = (page_num + PAGEBLOCK_PAGES - 1) >> PAGEBLOCK_ORDER;
+    unsigned long meta_size = PAGE_ALIGN(map_size + page_num + pageblock_num);
+    void *meta = memblock_alloc(meta_size, PAGE_SIZE);
+    if (meta == NULL) {
+        uart_puts("No free memory for the page metadata!\r\n");
+        return;
     }
+    memset(meta, 0, meta_size);
 
-    for (int i=0; i<PAGE_NUM; i++) page_list[i].cache_order = -1;
+    // Lay out the bitmap of each order, followed by the page bytes and the pageblock bytes
+    uint64_t *map = (uint64_t*)meta;
+    for (int i = 0; i < MAX_ORDER; i++) {
+        free_map[i] = map;
+        map += (page_num >> i) / 64 + 1;
+    }
+    page_meta = (uint8_t*)meta + map_size;
+    pageblock_class = page_meta + page_num;
+
+    // Every pageblock starts as temporary, the other classes claim pageblocks as they need them
+    for (int i = 0; i < pageblock_num; i++) {
+        pageblock_class[i] = ALLOC_TEMPORARY;
+    }
+
+    // memblock_dump();
+    struct MemRegion range;
+    unsigned long cursor = 0;
+    while (memblock_next_free(&cursor, &range)) {
+        add_free_range((range.start - mem_start) / PAGE_SIZE, (range.end - mem_start) / PAGE_SIZE);
+    }
+    mm_ready = 1;
+
+    uart_puts("Memory: ");
+    uart_hex(mem_start);
+    uart_puts(" - ");
+    uart_hex(mem_end);
+    uart_puts(", ");
+    uart_puts(itoa(page_num));
+    uart_puts(" pages, metadata at ");
+    uart_hex((unsigned long)meta);
+    uart_puts("\r\n");
 
     // print_free_list();
 }
 
+// Remove the free block at `idx` and split it down to `order`, the halves go back to their pageblock's lists
+static void take_block(int idx, int block_order, int order) {
+    rm_from_free_list(idx, block_order);
+    while (block_order > order) {
+        block_order--;
+        add_to_free_list(idx + (1 << block_order), block_order);
+        mm_stats.split_cnt++;
+    }
+}
+
+// Hand a pageblock over to `class`, moving the free blocks inside it to the lists of that class
+static void claim_pageblock(int pb, int class) {
+    if (pageblock_class[pb] == class) return;
+    pageblock_class[pb] = class;
+    mm_stats.pageblock_claim_cnt[class]++;
+
+    int start = pb << PAGEBLOCK_ORDER;
+    int end = start + PAGEBLOCK_PAGES < page_num ? start + PAGEBLOCK_PAGES : page_num;
+    int max_order = PAGEBLOCK_ORDER < MAX_ORDER - 1 ? PAGEBLOCK_ORDER : MAX_ORDER - 1;
+    for (int i = start; i < end;) {
+        int order = max_order;
+        while (order > 0 && ((i & ((1 << order) - 1)) || !test_free(i, order))) {
+            order--;
+        }
+        if (test_free(i, order)) {
+            rm_from_free_list(i, order);
+            add_to_free_list(i, order);
+            i += (1 << order);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+/**
+ * steal_block - Take a block from the free lists of another class
+ *
+ * The largest free block is taken, so that a whole pageblock can change
+ * hands instead of mixing classes in many pageblocks. A block covering
+ * whole pageblocks gives its first one to the requesting class. Smaller
+ * blocks bring their pageblock along when they are at least half of it, or
+ * when the request is long-lived, since those pageblocks are the ones that
+ * must not be polluted.
+ *
+ * @return The index of the block, -1 if there is no free memory at all
+ */
+static int steal_block(int order, int class) {
+    for (int i = MAX_ORDER - 1; i >= order; i--) {
+        for (int f = 0; f < ALLOC_CLASSES - 1; f++) {
+            int from = class_fallbacks[class][f];
+            if (free_list[i][from] == NULL) continue;
+
+            int idx = block_to_idx(free_list[i][from]);
+            mm_stats.fallback_cnt[class]++;
+            if (i >= PAGEBLOCK_ORDER) {
+                // Only the first pageblock changes hands, the halves split off the rest stay where they were
+                pageblock_class[idx >> PAGEBLOCK_ORDER] = class;
+                mm_stats.pageblock_claim_cnt[class]++;
+            }
+            else if (i >= PAGEBLOCK_ORDER / 2 || class != ALLOC_TEMPORARY) {
+                claim_pageblock(idx >> PAGEBLOCK_ORDER, class);
+            }
+            take_block(idx, i, order);
+            return idx;
+        }
+    }
+    return -1;
+}
+
+// Take a block of `order` from the free lists of `class`, falling back to the other classes
+static int buddy_alloc(int order, int class) {
+    for (int i = order; i < MAX_ORDER; i++) {
+        if (free_list[i][class] != NULL) {
+            int idx = block_to_idx(free_list[i][class]);
+            take_block(idx, i, order);
+            return idx;
+        }
+    }
+    return steal_block(order, class);
+}
+
+// Give a block back to the free lists, merging with the buddy block while it is free
+static int buddy_free(int idx, int order) {
+    page_meta[idx] = 0;
+    while (order < MAX_ORDER - 1) {
+        int buddy_idx = get_buddy(idx, order);
+        if (buddy_idx >= page_num || !test_free(buddy_idx, order)) break;
+
+        rm_from_free_list(buddy_idx, order);
+        idx = idx < buddy_idx ? idx : buddy_idx;
+        order++;
+        mm_stats.merge_cnt++;
+    }
+    add_to_free_list(idx, order);
+    return idx;
+}
+
+static inline struct PageCache* pcp_of(int idx, int order) {
+    return &pcp[order][pageblock_class[idx >> PAGEBLOCK_ORDER]];
+}
+
+static void pcp_push(struct PageCache *cache, int idx) {
+    struct FreeBlock *entry = idx_to_block(idx);
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL) {
+        cache->head->prev = entry;
+    }
+    else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+    cache->count++;
+}
+
+static int pcp_pop(struct PageCache *cache) {
+    struct FreeBlock *entry = cache->head;
+    cache->head = entry->next;
+    if (cache->head != NULL) {
+        cache->head->prev = NULL;
+    }
+    else {
+        cache->tail = NULL;
+    }
+    cache->count--;
+    return block_to_idx(entry);
+}
+
+// Fill an empty cache with `batch` blocks from the buddy lists
+static void pcp_refill(int order, int class) {
+    struct PageCache *cache = &pcp[order][class];
+    for (int i = 0; i < cache->batch; i++) {
+        int idx = buddy_alloc(order, class);
+        if (idx < 0) break;
+        page_meta[idx] = PAGE_PCP | order;
+        pcp_push(cache, idx);
+    }
+}
+
+// Give the `count` coldest blocks of a cache back to the buddy lists
+static void pcp_drain(struct PageCache *cache, int order, int count) {
+    while (count-- > 0 && cache->tail != NULL) {
+        struct FreeBlock *entry = cache->tail;
+        cache->tail = entry->prev;
+        if (cache->tail != NULL) {
+            cache->tail->next = NULL;
+        }
+        else {
+            cache->head = NULL;
+        }
+        cache->count--;
+        buddy_free(block_to_idx(entry), order);
+    }
+}
+
+static void pcp_init() {
+    for (int i = 0; i < PCP_ORDERS; i++) {
+        for (int c = 0; c < ALLOC_CLASSES; c++) {
+            pcp[i][c].head = NULL;
+            pcp[i][c].tail = NULL;
+            pcp[i][c].count = 0;
+            pcp[i][c].high = PCP_HIGH;
+            pcp[i][c].batch = PCP_BATCH;
+        }
+    }
+}
+
+/**
+ * pcp_set_high - Set the high watermark of the hot page caches of an order
+ *
+ * The watermark applies to the cache of each class. A watermark of 0
+ * disables the caches, every free then goes straight to the buddy lists.
+ * Set from the shell with `meminfo pcp <order> <high>`.
+ *
+ * @return 0 on success, -1 if the order has no cache or the watermark is negative
+ */
+int pcp_set_high(int order, int high) {
+    if (order < 0 || order >= PCP_ORDERS || high < 0) return -1;
+    unsigned long flags = zone_lock_irqsave();
+    for (int c = 0; c < ALLOC_CLASSES; c++) {
+        struct PageCache *cache = &pcp[order][c];
+        cache->high = high;
+        cache->batch = high < PCP_BATCH ? high : PCP_BATCH;
+        if (cache->count > high) {
+            pcp_drain(cache, order, cache->count - high);
+        }
+    }
+    zone_unlock_irqrestore(flags);
+    return 0;
+}
+
+// Give every cached block back to the buddy lists
+void pcp_drain_all() {
+    unsigned long flags = zone_lock_irqsave();
+    for (int i = 0; i < PCP_ORDERS; i++) {
+        for (int c = 0; c < ALLOC_CLASSES; c++) {
+            pcp_drain(&pcp[i][c], i, pcp[i][c].count);
+        }
+    }
+    zone_unlock_irqrestore(flags);
+}
+
+/**
+ * zero_pool_fill - Zero free pages ahead of time
+ *
+ * Called from the idle loop. Pages are only taken from the free lists of
+ * `ALLOC_TEMPORARY`, the class of the stacks and file buffers that ask for
+ * zeroed memory, so filling the pool never causes a fallback. Nothing is
+ * zeroed while the last watermark seen is low or critical.
+ *
+ * @param budget: Maximum number of pages zeroed by this call
+ * @return The number of pages zeroed, 0 once there is nothing left to do
+ */
+int zero_pool_fill(int budget) {
+    if (!mm_ready || wmark_level != WMARK_OK) return 0;  // Keep the free pages for allocations that need them
+    int zeroed = 0;
+    while (zeroed < budget && zero_pool_cnt < ZERO_POOL_HIGH) {
+        unsigned long flags = zone_lock_irqsave();
+        int order = 0;
+        while (order < MAX_ORDER && free_list[order][ALLOC_TEMPORARY] == NULL) order++;
+        if (order == MAX_ORDER) {
+            zone_unlock_irqrestore(flags);
+            break;
+        }
+
+        int idx = block_to_idx(free_list[order][ALLOC_TEMPORARY]);
+        take_block(idx, order, 0);
+        page_meta[idx] = PAGE_ALLOCATED;
+        zone_unlock_irqrestore(flags);
+
+        // Zeroed without the lock, the page is not reachable by anyone else
+        void *page = memory_start + (unsigned long)idx * PAGE_SIZE;
+        memset(page, 0, PAGE_SIZE);
+
+        flags = zone_lock_irqsave();
+        if (zero_pool_cnt < ZERO_POOL_HIGH) {
+            zero_pool[zero_pool_cnt++] = page;
+        }
+        else {  // Another core filled the pool meanwhile
+            buddy_free(idx, 0);
+        }
+        zone_unlock_irqrestore(flags);
+        zeroed++;
+    }
+    return zeroed;
+}
+
+// Give the zeroed pages back to the buddy lists, they are zeroed again later
+void zero_pool_drain() {
+    unsigned long flags = zone_lock_irqsave();
+    while (zero_pool_cnt > 0) {
+        void *page = zero_pool[--zero_pool_cnt];
+        buddy_free((page - memory_start) / PAGE_SIZE, 0);
+    }
+    zone_unlock_irqrestore(flags);
+}
+
+int zero_pool_pages() {
+    return zero_pool_cnt;
+}
+
+/**
+ * _alloc_zeroed - Allocate zero-filled pages for a short-lived buffer
+ *
+ * Single pages come from the pool zeroed by the idle task. Larger blocks,
+ * or any block when the pool is empty, are cleared here. The memory belongs
+ * to `ALLOC_TEMPORARY` and is freed with `_free`.
+ *
+ * @param size: The size of memory to allocate, rounded up to a power of two pages
+ * @return Pointer to the zeroed memory, NULL if there is not enough memory
+ */
+void* _alloc_zeroed(unsigned int size) {
+    if (size > 0 && size <= PAGE_SIZE && zero_pool_cnt > 0) {
+        unsigned long flags = zone_lock_irqsave();
+        void *page = zero_pool_cnt > 0 ? zero_pool[--zero_pool_cnt] : NULL;
+        if (page != NULL) {
+            mm_stats.zero_hit_cnt++;
+            mm_stats.alloc_cnt[0]++;
+        }
+        zone_unlock_irqrestore(flags);
+        if (page != NULL) return page;
+    }
+
+    void *addr = _alloc_class(size, ALLOC_TEMPORARY);
+    if (addr == NULL) return NULL;
+    mm_stats.zero_miss_cnt++;
+    memset(addr, 0, PAGE_SIZE << get_order(round(size)));
+    return addr;
+}
+
+// Pages in the buddy free lists, the hot page caches are not included
+unsigned long mm_free_pages() {
+    unsigned long pages = 0;
+    for (int i = 0; i < MAX_ORDER; i++) {
+        pages += mm_stats.free_blocks[i] << i;
+    }
+    return pages;
+}
+
+/**
+ * mm_frag_index - Unusable free space index of an order
+ *
+ * The share of free memory that sits in blocks too small to serve an
+ * allocation of `order`: 0 when every free page is usable, 1000 when none is.
+ *
+ * @return The index in permille, 0 when there is no free memory
+ */
+int mm_frag_index(int order) {
+    unsigned long total = mm_free_pages();
+    if (total == 0 || order < 0 || order >= MAX_ORDER) return 0;
+
+    unsigned long usable = 0;
+    for (int i = order; i < MAX_ORDER; i++) {
+        usable += mm_stats.free_blocks[i] << i;
+    }
+    return (total - usable) * 1000 / total;
+}
+
+int pcp_cached_pages() {
+    int pages = 0;
+    for (int i = 0; i < PCP_ORDERS; i++) {
+        for (int c = 0; c < ALLOC_CLASSES; c++) {
+            pages += pcp[i][c].count << i;
+        }
+    }
+    return pages;
+}
+
+int pageblock_count(int alloc_class) {
+    int cnt = 0;
+    for (int i = 0; i < (page_num + PAGEBLOCK_PAGES - 1) >> PAGEBLOCK_ORDER; i++) {
+        if (pageblock_class[i] == alloc_class) cnt++;
+    }
+    return cnt;
+}
+
+const char* alloc_class_name(int alloc_class) {
+    if (alloc_class < 0 || alloc_class >= ALLOC_CLASSES) return "?";
+    return class_names[alloc_class];
+}
+
+void print_alloc_class_stats() {
+    for (int c = 0; c < ALLOC_CLASSES; c++) {
+        uart_puts((char*)class_names[c]);
+        uart_puts(": ");
+        uart_puts(itoa(pageblock_count(c)));
+        uart_puts(" pageblocks, ");
+        uart_puts(itoa(mm_stats.fallback_cnt[c]));
+        uart_puts(" fallbacks, ");
+        uart_puts(itoa(mm_stats.pageblock_claim_cnt[c]));
+        uart_puts(" pageblocks claimed\r\n");
+    }
+}
+
+// Take a block from the hot page cache or the buddy lists, -1 if there is none
+static int alloc_block(int order, int alloc_class) {
+    if (order < PCP_ORDERS && pcp[order][alloc_class].high > 0) {
+        struct PageCache *cache = &pcp[order][alloc_class];
+        if (cache->count == 0) {
+            pcp_refill(order, alloc_class);
+        }
+        else {
+            mm_stats.pcp_hit_cnt++;
+        }
+        if (cache->count == 0) return -1;
+        return pcp_pop(cache);
+    }
+    return buddy_alloc(order, alloc_class);
+}
+
+/**
+ * register_shrinker - Register a callback that releases cached memory
+ *
+ * Before an allocation fails, every shrinker is asked to give memory back
+ * with `_free` or `kfree`, then the allocation is retried once. The idle
+ * task also runs them when the free pages fall below the low watermark.
+ * Shrinkers may allocate, but must not rely on it succeeding. They run on
+ * whichever core allocates, IRQ handlers included, maybe in the middle of an
+ * operation on the memory they release: a shrinker only tries the lock of
+ * what it walks and returns 0 when it is taken.
+ *
+ * @param name: Shown by `meminfo`
+ * @param shrink: Returns the number of pages it released
+ * @return 0 on success, -1 if the registry is full
+ */
+int register_shrinker(const char *name, int (*shrink)(void)) {
+    if (shrinker_num == MAX_SHRINKERS) {
+        uart_puts("[!] register_shrinker: too many shrinkers!\r\n");
+        return -1;
+    }
+    shrinkers[shrinker_num++] = (struct Shrinker){ .name = name, .shrink = shrink };
+    return 0;
+}
+
+// Run every shrinker, return the number of pages they released
+int shrink_all() {
+    int pages = 0;
+    if (!spin_trylock(&shrink_lock)) return 0;  // Another core is shrinking, the shrinkers do not run concurrently
+    for (int i = 0; i < shrinker_num; i++) {
+        int freed = shrinkers[i].shrink();
+        shrinkers[i].call_cnt++;
+        if (freed > 0) {
+            shrinkers[i].freed_pages += freed;
+            pages += freed;
+        }
+    }
+    spin_unlock(&shrink_lock);
+    return pages;
+}
+
+int shrinker_count() {
+    return shrinker_num;
+}
+
+const struct Shrinker* shrinker_get(int i) {
+    if (i < 0 || i >= shrinker_num) return NULL;
+    return &shrinkers[i];
+}
+
+// Pages that can be handed out without a shrinker: the buddy lists, the hot page caches and the zeroed pool
+unsigned long mm_available_pages() {
+    return mm_free_pages() + pcp_cached_pages() + zero_pool_cnt;
+}
+
+// Free pages under which the allocator is at `level`
+unsigned long wmark_pages(int level) {
+    if (level == WMARK_CRITICAL) return page_num / WMARK_CRITICAL_DIV;
+    if (level == WMARK_LOW) return page_num / WMARK_LOW_DIV;
+    return 0;
+}
+
+const char* wmark_name(int level) {
+    if (level == WMARK_CRITICAL) return "critical";
+    if (level == WMARK_LOW) return "low";
+    return "ok";
+}
+
+/**
+ * mm_watermark - Compare the available pages with the watermarks
+ *
+ * Each fall to a lower level is counted in `mm_stats`. The level is sampled
+ * by the callers (the idle task, the pressure path, `meminfo`), not on every
+ * allocation.
+ *
+ * @return `WMARK_OK`, `WMARK_LOW` or `WMARK_CRITICAL`
+ */
+int mm_watermark() {
+    unsigned long avail = mm_available_pages();
+    int level = WMARK_OK;
+    if (avail < wmark_pages(WMARK_CRITICAL)) level = WMARK_CRITICAL;
+    else if (avail < wmark_pages(WMARK_LOW)) level = WMARK_LOW;
+
+    if (level > wmark_level) {
+        if (wmark_level < WMARK_LOW) mm_stats.wmark_low_cnt++;
+        if (level == WMARK_CRITICAL) mm_stats.wmark_critical_cnt++;
+    }
+    wmark_level = level;
+    return level;
+}
+
+/**
+ * mm_reclaim - Release cached memory ahead of time, below the low watermark
+ *
+ * Called from the idle loop, so that allocations keep finding free pages
+ * instead of running the shrinkers themselves. Once run, the shrinkers are
+ * only run again after more memory was taken.
+ */
+void mm_reclaim() {
+    if (!mm_ready || mm_watermark() == WMARK_OK) {
+        reclaim_mark = 0;
+        return;
+    }
+    if (reclaim_mark != 0 && mm_available_pages() >= reclaim_mark) return;  // Nothing was taken since the last run
+
+    mm_stats.reclaim_cnt++;
+    shrink_all();
+    pcp_drain_all();
+    reclaim_mark = mm_available_pages();
+    if (reclaim_mark == 0) reclaim_mark = 1;
+    mm_watermark();
+}
+
+// Give back the memory held by caches in front of the buddy lists, return 1 if anything was released
+static int relieve_pressure() {
+    int released = 0;
+    mm_stats.pressure_cnt++;
+    mm_watermark();
+
+    // The zeroed pages may complete a block, zeroing them again is cheaper than failing
+    if (zero_pool_cnt > 0) {
+        zero_pool_drain();
+        released = 1;
+    }
+    if (shrink_all() > 0) {
+        released = 1;
+    }
+    // Last, so that the pages released by the shrinkers reach the buddy lists too
+    if (pcp_cached_pages() > 0) {
+        pcp_drain_all();
+        released = 1;
+    }
+    return released;
+}
+
 void* _alloc(unsigned int size) {
+    return _alloc_class(size, ALLOC_UNMOVABLE);
+}
+
+/**
+ * _alloc_class - Allocate pages for an expected lifetime
+ *
+ * @param size: The size of memory to allocate, rounded up to a power of two pages
+ * @param alloc_class: One of `ALLOC_*`, `_alloc` uses `ALLOC_UNMOVABLE`
+ * @return Pointer to the allocated memory, NULL if there is not enough memory
+ */
+void* _alloc_class(unsigned int size, int alloc_class) {
+    if (alloc_class < 0 || alloc_class >= ALLOC_CLASSES) alloc_class = ALLOC_UNMOVABLE;
     if (size == 0 || size > MAX_ALLOC_SIZE) {
         uart_puts("The requested size is invalid!\n");
         return NULL;
@@ -180,150 +855,295 @@ void* _alloc(unsigned int size) {
     // Calculate the order of the block
     int order = get_order(size);
 
-    // Find a free block of the required size
-    for (int i = order; i < MAX_ORDER; i++) {
-        if (free_list[i] != NULL) {
-            struct PageInfo *block = free_list[i];
-            rm_from_free_list(block, i);  // Remove from the free list          
-
-            // Found a block in higher order, split it into smaller blocks
-            while (i > order) {
-                i--;
-                struct PageInfo *new_entry = block + (1 << i);
-                new_entry->idx = block->idx + (1 << i);
-                add_to_free_list(new_entry, i);
-
-                page_list[new_entry->idx].order = i;
-                page_list[new_entry->idx].entry_in_list = new_entry;  // Link to the free list entry
-            }
-
-            // Mark the block as allocated
-            page_list[block->idx].order = order;
-            // page_list[block->idx].allocated = 1;  // Mark as allocated
-            page_list[block->idx].entry_in_list = NULL;  // Unlink from the free list
-            
-            void *addr = memory_start + block->idx * PAGE_SIZE;
-            // print_alloc_page_msg(addr, block->idx, order);
-            // print_free_list();
-            return addr;
-        }
+    unsigned long flags = zone_lock_irqsave();
+    int idx = alloc_block(order, alloc_class);
+    if (idx < 0) {
+        zone_unlock_irqrestore(flags);
+        int released = relieve_pressure();
+        flags = zone_lock_irqsave();
+        if (released) idx = alloc_block(order, alloc_class);
     }
-    return NULL;  // No suitable block found
+    if (idx < 0) {
+        mm_stats.alloc_fail_cnt++;
+        zone_unlock_irqrestore(flags);
+        return NULL;
+    }
+
+    // Mark the block as allocated
+    page_meta[idx] = PAGE_ALLOCATED | order;
+    mm_stats.alloc_cnt[order]++;
+    zone_unlock_irqrestore(flags);
+
+    void *addr = memory_start + (unsigned long)idx * PAGE_SIZE;
+    // print_alloc_page_msg(addr, idx, order);
+    // print_free_list();
+    return addr;
 }
 
 void _free(void *ptr) {
     if (ptr == NULL) return;
 
     int original_idx = (ptr - memory_start) / PAGE_SIZE;
+    if (original_idx < 0 || original_idx >= page_num) return;
 
-    // Check if the pointer is valid
-    if (original_idx < 0 || original_idx >= PAGE_NUM || page_list[original_idx].entry_in_list != NULL) {
+    // Check if the pointer is valid: it must be the head of an allocated block
+    unsigned long flags = zone_lock_irqsave();
+    if ((page_meta[original_idx] & (PAGE_ALLOCATED | PAGE_PCP | PAGE_SLAB)) != PAGE_ALLOCATED) {
+        zone_unlock_irqrestore(flags);
         return;
     }
 
-    // Merge with the buddy block if it is free
-    int order = page_list[original_idx].order;
-    int curr_idx = original_idx, buddy_idx = get_buddy(original_idx, order);
-    int smaller_idx = -1, bigger_idx = -1;
-    int have_merged = 0;
-    
-    while (order < MAX_ORDER - 1) {
-        struct PageInfo *buddy_entry = page_list[buddy_idx].entry_in_list;
-
-        // uart_puts("[*] buddy idx: ");
-        // if (buddy_entry != NULL) uart_puts(itoa(buddy_entry->idx));
-        // else uart_puts("NULL");
-        // uart_puts(" for page ");
-        // uart_puts(itoa(curr_idx));
-        // uart_puts(" with order ");
-        // uart_puts(itoa(order));
-        // uart_puts("\r\n");
-
-        if (buddy_entry && page_list[buddy_idx].order == page_list[curr_idx].order) {  // Have buddy
-            // uart_puts("[*] Buddy found! buddy idx: ");
-            // uart_puts(itoa(buddy_entry->idx));
-            // uart_puts(" for page ");
-            // uart_puts(itoa(curr_idx));
-            // uart_puts(" with order ");
-            // uart_puts(itoa(order));
-            // uart_puts("\r\n");
-
-            // rm_from_free_list(page_list[curr_idx].entry_in_list, order);
-            rm_from_free_list(buddy_entry, order);
-
-            bigger_idx = curr_idx > buddy_idx ? curr_idx : buddy_idx;
-            smaller_idx = curr_idx < buddy_idx ? curr_idx : buddy_idx;
-
-            order++;
-
-            // Add the merged block to the free list
-            // struct Block *new_entry = (struct Block*)simple_alloc(sizeof(struct Block));
-            // new_entry->idx = smaller_idx;
-            // add_to_free_list(new_entry, order);
-
-            // Update the page list
-            // page_list[smaller_idx].allocated = 0;
-            // page_list[bigger_idx].allocated = 0;
-            page_list[smaller_idx].order = order;
-            page_list[bigger_idx].order = -1;
-            // page_list[smaller_idx].entry_in_list = new_entry;
-            page_list[bigger_idx].entry_in_list = NULL;
-
-            curr_idx = smaller_idx;
-            buddy_idx = get_buddy(curr_idx, order);
-
-            // have_merged = 1;
+    int order = page_meta[original_idx] & PAGE_ORDER_MASK;
+    mm_stats.free_cnt[order]++;
+
+    // Keep small blocks hot, drain a batch of the coldest ones above the watermark
+    if (order < PCP_ORDERS && pcp_of(original_idx, order)->high > 0) {
+        struct PageCache *cache = pcp_of(original_idx, order);
+        page_meta[original_idx] = PAGE_PCP | order;
+        pcp_push(cache, original_idx);
+        if (cache->count > cache->high) {
+            pcp_drain(cache, order, cache->batch);
         }
-        else {
-            struct PageInfo *new_entry = page_list + curr_idx;
-            new_entry->idx = curr_idx;
-            add_to_free_list(new_entry, order);
+        zone_unlock_irqrestore(flags);
+        return;
+    }
 
-            page_list[curr_idx].entry_in_list = new_entry;  // Link to the free list entry
-            page_list[curr_idx].order = order;  // Update the order
-            // page_list[curr_idx].allocated = 0;  // Mark as free
-            break;
+    buddy_free(original_idx, order);
+    zone_unlock_irqrestore(flags);
+
+    // print_free_page_msg(ptr, original_idx, -1, order);
+    // print_free_list();
+}
+
+/**
+ * _resize_in_place - Grow or shrink an allocated block without moving it
+ *
+ * A block grows by taking its upper buddies, so it must be aligned to the new
+ * order and each buddy must be a whole free block. Shrinking gives the upper
+ * halves back to the free lists.
+ *
+ * @param ptr: The head of a block returned by `_alloc`
+ * @param size: The new size, rounded up to a power of two pages
+ * @return 0 if the block now has the new size, -1 if it cannot grow in place
+ */
+int _resize_in_place(void *ptr, unsigned int size) {
+    if (ptr == NULL || size == 0 || size > MAX_ALLOC_SIZE) return -1;
+
+    int idx = (ptr - memory_start) / PAGE_SIZE;
+    if (idx < 0 || idx >= page_num) return -1;
+
+    unsigned long flags = zone_lock_irqsave();
+    if ((page_meta[idx] & (PAGE_ALLOCATED | PAGE_PCP | PAGE_SLAB)) != PAGE_ALLOCATED) {
+        zone_unlock_irqrestore(flags);
+        return -1;
+    }
+
+    int order = page_meta[idx] & PAGE_ORDER_MASK;
+    int new_order = get_order(round(size));
+
+    if (new_order > order) {
+        int can_grow = (idx & ((1 << new_order) - 1)) == 0;
+        for (int i = order; i < new_order && can_grow; i++) {
+            int buddy_idx = idx + (1 << i);
+            if (buddy_idx >= page_num || !test_free(buddy_idx, i)) can_grow = 0;
+        }
+        if (!can_grow) {
+            zone_unlock_irqrestore(flags);
+            return -1;
+        }
+        for (int i = order; i < new_order; i++) {
+            rm_from_free_list(idx + (1 << i), i);
+        }
+        mm_stats.grow_cnt++;
+    }
+    else {
+        // The lower half stays allocated, so the upper halves cannot merge back into the block
+        for (int i = order - 1; i >= new_order; i--) {
+            buddy_free(idx + (1 << i), i);
         }
     }
 
-    // if (!have_merged) {
-    //     struct Block *new_entry = (struct Block*)simple_alloc(sizeof(struct Block));
-    //     new_entry->idx = curr_idx;
-    //     add_to_free_list(new_entry, order);
+    page_meta[idx] = PAGE_ALLOCATED | new_order;
+    zone_unlock_irqrestore(flags);
+    return 0;
+}
 
-    //     page_list[curr_idx].entry_in_list = new_entry;  // Link to the free list entry
-    //     page_list[curr_idx].order = order;  // Update the order
-    //     page_list[curr_idx].allocated = 0;  // Mark as free
-    // }
+// Size in bytes of the block allocated at `ptr`, 0 if `ptr` is not the head of an allocated block
+unsigned long _block_size(void *ptr) {
+    int idx = (ptr - memory_start) / PAGE_SIZE;
+    if (idx < 0 || idx >= page_num || (page_meta[idx] & (PAGE_ALLOCATED | PAGE_PCP | PAGE_SLAB)) != PAGE_ALLOCATED) {
+        return 0;
+    }
+    return (unsigned long)PAGE_SIZE << (page_meta[idx] & PAGE_ORDER_MASK);
+}
 
-    // print_free_page_msg(ptr, original_idx, curr_idx, order);
-    // print_free_list();
+// Class of the pageblock holding an allocated block, so a moved block keeps its lifetime
+int block_alloc_class(void *ptr) {
+    int idx = (ptr - memory_start) / PAGE_SIZE;
+    if (idx < 0 || idx >= page_num) return ALLOC_UNMOVABLE;
+    return pageblock_class[idx >> PAGEBLOCK_ORDER];
+}
+
+// Take `count` blocks of `order` with a single walk of the free lists of a class, return how many were taken
+static int buddy_alloc_bulk(int order, int class, int count, int *idx_out) {
+    int got = 0;
+    for (int i = order; i < MAX_ORDER && got < count;) {
+        if (free_list[i][class] == NULL) {
+            i++;
+            continue;
+        }
+        int idx = block_to_idx(free_list[i][class]);
+        rm_from_free_list(idx, i);
+
+        // Carve the blocks from the front, the remainder goes back as aligned blocks
+        int pieces = 1 << (i - order);
+        int take = pieces < count - got ? pieces : count - got;
+        for (int k = 0; k < take; k++) {
+            idx_out[got++] = idx + (k << order);
+        }
+        add_free_range(idx + (take << order), idx + (1 << i));
+        // Splits `take_block` would have made: each block above `order` that holds a taken piece
+        for (int level = 1; level <= i - order; level++) {
+            mm_stats.split_cnt += (take + (1 << level) - 1) >> level;
+        }
+    }
+
+    // The class ran out, fall back block by block
+    while (got < count) {
+        int idx = steal_block(order, class);
+        if (idx < 0) break;
+        idx_out[got++] = idx;
+    }
+    return got;
+}
+
+/**
+ * _alloc_bulk - Allocate several blocks of the same order at once
+ *
+ * Blocks come from the hot page cache first, the rest is carved from the
+ * free lists in one pass instead of one walk and split cascade per block.
+ * Either all the blocks are allocated or none.
+ *
+ * @param order: Order of each block
+ * @param count: Number of blocks, up to `MAX_BULK`
+ * @param out: Filled with the address of each block
+ * @return 0 on success, -1 if there is not enough memory
+ */
+int _alloc_bulk(int order, int count, void **out) {
+    return _alloc_bulk_class(order, ALLOC_UNMOVABLE, count, out);
+}
+
+// Same as `_alloc_bulk`, for an `ALLOC_*` lifetime class
+int _alloc_bulk_class(int order, int alloc_class, int count, void **out) {
+    if (order < 0 || order >= MAX_ORDER || count <= 0 || count > MAX_BULK) return -1;
+    if (alloc_class < 0 || alloc_class >= ALLOC_CLASSES) alloc_class = ALLOC_UNMOVABLE;
+
+    int idx[MAX_BULK];
+    int got = 0;
+    unsigned long flags = zone_lock_irqsave();
+    if (order < PCP_ORDERS) {
+        struct PageCache *cache = &pcp[order][alloc_class];
+        while (got < count && cache->count > 0) {
+            idx[got++] = pcp_pop(cache);
+            mm_stats.pcp_hit_cnt++;
+        }
+    }
+    got += buddy_alloc_bulk(order, alloc_class, count - got, idx + got);
+    if (got < count) {
+        // The blocks taken so far stay ours while the shrinkers run without the lock
+        zone_unlock_irqrestore(flags);
+        int released = relieve_pressure();
+        flags = zone_lock_irqsave();
+        if (released) got += buddy_alloc_bulk(order, alloc_class, count - got, idx + got);
+    }
+
+    if (got < count) {
+        for (int i = 0; i < got; i++) {
+            buddy_free(idx[i], order);
+        }
+        mm_stats.alloc_fail_cnt++;
+        zone_unlock_irqrestore(flags);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        page_meta[idx[i]] = PAGE_ALLOCATED | order;
+        out[i] = memory_start + (unsigned long)idx[i] * PAGE_SIZE;
+    }
+    mm_stats.alloc_cnt[order] += count;
+    zone_unlock_irqrestore(flags);
+    return 0;
+}
+
+/**
+ * _free_bulk - Free several blocks allocated by `_alloc` or `_alloc_bulk`
+ *
+ * Cached orders are pushed to their hot page cache and drained at most once,
+ * down to the high watermark, at the end. NULL entries are skipped.
+ */
+void _free_bulk(void **ptrs, int count) {
+    unsigned long flags = zone_lock_irqsave();
+    for (int i = 0; i < count; i++) {
+        if (ptrs[i] == NULL) continue;
+        int idx = (ptrs[i] - memory_start) / PAGE_SIZE;
+        if (idx < 0 || idx >= page_num || (page_meta[idx] & (PAGE_ALLOCATED | PAGE_PCP | PAGE_SLAB)) != PAGE_ALLOCATED) {
+            continue;
+        }
+
+        int order = page_meta[idx] & PAGE_ORDER_MASK;
+        mm_stats.free_cnt[order]++;
+        if (order < PCP_ORDERS && pcp_of(idx, order)->high > 0) {
+            page_meta[idx] = PAGE_PCP | order;
+            pcp_push(pcp_of(idx, order), idx);
+        }
+        else {
+            buddy_free(idx, order);
+        }
+    }
+
+    for (int i = 0; i < PCP_ORDERS; i++) {
+        for (int c = 0; c < ALLOC_CLASSES; c++) {
+            struct PageCache *cache = &pcp[i][c];
+            if (cache->count > cache->high) {
+                pcp_drain(cache, i, cache->count - cache->high);
+            }
+        }
+    }
+    zone_unlock_irqrestore(flags);
 }
 
 void split(unsigned int idx, unsigned int order) {
-    if (order >= MAX_ORDER) return;
-    struct PageInfo *entry = page_list + idx;
-    rm_from_free_list(entry, order);
-    page_list[idx].entry_in_list = NULL;
+    if (order == 0 || order >= MAX_ORDER) return;
+    rm_from_free_list(idx, order);
 
     order--;
-    entry->idx = idx;
-    entry->order = order;
-    add_to_free_list(entry, order);
-    page_list[idx].entry_in_list = entry;
-
-    int buddy_idx = get_buddy(idx, order);
-    struct PageInfo *buddy_entry = page_list + buddy_idx;
-    buddy_entry->idx = buddy_idx;
-    buddy_entry->order = order;
-    add_to_free_list(buddy_entry, order);
-    page_list[buddy_idx].entry_in_list = buddy_entry;
+    add_to_free_list(idx, order);
+    add_to_free_list(get_buddy(idx, order), order);
+    mm_stats.split_cnt++;
 }
 
+/**
+ * reserve - Keep a physical range out of the page allocator
+ *
+ * Before `mm_init` the range goes to the boot memory map and is simply never
+ * freed. Afterwards the free blocks covering it are split and removed.
+ */
 void reserve(void *start, void *end) {
+    if (end <= start) return;
+    if (!mm_ready) {
+        memblock_reserve((unsigned long)start, end - start);
+        return;
+    }
+    reserve_pages(start, end);
+}
+
+static void reserve_pages(void *start, void *end) {
     end--;  // Exclude the end address
+    if (end < memory_start || start >= memory_start + (unsigned long)page_num * PAGE_SIZE) return;
+    if (start < memory_start) start = memory_start;
     unsigned int start_idx = (start - memory_start) / PAGE_SIZE;
     unsigned int end_idx = (end - memory_start) / PAGE_SIZE;
+    if (end_idx >= page_num) end_idx = page_num - 1;
 
     // uart_puts("[x] Reserve memory from ");
     // uart_hex((unsigned long)start);
@@ -335,61 +1155,29 @@ void reserve(void *start, void *end) {
     // uart_puts(itoa(end_idx));
     // uart_puts(")\r\n");
 
-    // Split the chunk
+    // Split the free blocks crossing the boundaries of the interval
     for (int curr_order=MAX_ORDER-1; curr_order>0; curr_order--) {
-        unsigned int start_block_idx = start_idx - (start_idx & (1 << curr_order) - 1);
-        unsigned int end_block_idx = end_idx - (end_idx & (1 << curr_order) - 1);
-        // uart_puts("start_block_idx: ");
-        // uart_puts(itoa(start_block_idx));
-        // uart_puts(" end_block_idx: ");
-        // uart_puts(itoa(end_block_idx));
-        // uart_puts(" curr_order: ");
-        // uart_puts(itoa(curr_order));
-        // uart_puts("\r\n");
-
-        if(start_block_idx == end_block_idx) {  // The whole interval is in the same block
-            // uart_puts("[*] The whole interval is in the same block: ");
-            // uart_puts(itoa(start_block_idx));
-            // uart_puts(" with order ");
-            // uart_puts(itoa(curr_order));
-            // uart_puts("\r\n");
-
-            if (page_list[start_block_idx].order == curr_order) {
-                split(start_block_idx, curr_order);
-            }
+        unsigned int start_block_idx = start_idx - (start_idx & ((1 << curr_order) - 1));
+        unsigned int end_block_idx = end_idx - (end_idx & ((1 << curr_order) - 1));
+
+        if (test_free(start_block_idx, curr_order)) {
+            split(start_block_idx, curr_order);
         }
-        else {
-            // uart_puts("[*] The whole interval is in different blocks: ");
-            // uart_puts(itoa(start_block_idx));
-            // uart_puts(" with order ");
-            // uart_puts(itoa(curr_order));
-            // uart_puts(" and ");
-            // uart_puts(itoa(end_block_idx));
-            // uart_puts(" with order ");
-            // uart_puts(itoa(curr_order));
-            // uart_puts("\r\n");
-
-            if (page_list[start_block_idx].order == curr_order) {
-                split(start_block_idx, curr_order);
-            }
-            if (page_list[end_block_idx].order == curr_order) {
-                split(end_block_idx, curr_order);
-            }
-            // split(start_block_idx, curr_order);
-            // split(end_block_idx, curr_order);
+        if (end_block_idx != start_block_idx && test_free(end_block_idx, curr_order)) {
+            split(end_block_idx, curr_order);
         }
     }
 
-    // Reserve the page
-    for (int i=start_idx; i<=end_idx;) {
-        struct PageInfo *entry = page_list + i;
-        if (page_list[i].entry_in_list != NULL) {
-            rm_from_free_list(entry, entry->order);
-            page_list[i].entry_in_list = NULL;
+    // Reserve the pages, the free blocks left in the interval are fully inside it
+    for (unsigned int i=start_idx; i<=end_idx;) {
+        int order = MAX_ORDER - 1;
+        while (order > 0 && ((i & ((1 << order) - 1)) || !test_free(i, order))) {
+            order--;
+        }
+        if (test_free(i, order)) {
+            rm_from_free_list(i, order);
         }
-        // uart_puts(itoa(entry->order));
-        // uart_puts("\r\n");
-        i += (1 << entry->order);
+        i += (1 << order);
     }
 
     // print_free_list();
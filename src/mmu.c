@@ -0,0 +1,114 @@
+#include "mmu.h"
+
+#define KERNEL_PTE_TABLES 4  // Enough L3 tables to cover 8MB of kernel text
+
+extern char *__text_begin;
+extern char *__rodata_end;
+
+/*
+ * Identity map of the first 2GB of the physical address space.
+ *
+ * pgd (level 1) splits the 32-bit address space into 1GB entries: the first
+ * one points to pmd, the second one is a device block for the local
+ * peripherals. pmd (level 2) maps RAM as normal memory and the peripheral
+ * window as device memory in 2MB blocks. The 2MB blocks overlapping the
+ * kernel image are further split by kernel_pte (level 3) so that text can be
+ * mapped read-only and executable while everything else stays writable.
+ *
+ * Since the shell and user programs share this map and run at EL0, RAM is
+ * accessible from EL0. A writable region at EL0 is always privileged
+ * execute-never, which is why text must be mapped read-only.
+ */
+static uint64_t pgd[PT_ENTRIES] __attribute__((aligned(PT_SIZE)));
+static uint64_t pmd[PT_ENTRIES] __attribute__((aligned(PT_SIZE)));
+static uint64_t kernel_pte[KERNEL_PTE_TABLES][PT_ENTRIES] __attribute__((aligned(PT_SIZE)));
+
+static uint64_t ram_page_desc(unsigned long addr) {
+    if (addr >= (unsigned long)&__text_begin && addr < (unsigned long)&__rodata_end) {
+        return addr | PD_KERNEL_TEXT | PD_PAGE;
+    }
+    return addr | PD_KERNEL_DATA | PD_PAGE;
+}
+
+/**
+ * mmu_init - Build the boot identity map and turn on the MMU
+ *
+ * Called from `boot.S` after the BSS is cleared, so that every load and store
+ * from `main()` on, including `mm_init()`, goes through the data cache.
+ */
+void mmu_init() {
+    unsigned long text_begin = (unsigned long)&__text_begin & ~(L2_BLOCK_SIZE - 1);
+    unsigned long text_end = (unsigned long)&__rodata_end;
+    int pte_used = 0;
+
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        unsigned long addr = (unsigned long)i * L2_BLOCK_SIZE;
+
+        if (addr >= PERIPHERAL_BASE) {
+            pmd[i] = addr | PD_DEVICE | PD_BLOCK;
+        }
+        else if (addr >= text_begin && addr < text_end && pte_used < KERNEL_PTE_TABLES) {
+            uint64_t *pte = kernel_pte[pte_used++];
+            for (int j = 0; j < PT_ENTRIES; j++) {
+                pte[j] = ram_page_desc(addr + (unsigned long)j * L3_PAGE_SIZE);
+            }
+            pmd[i] = (uint64_t)pte | PD_TABLE;
+        }
+        else {
+            pmd[i] = addr | PD_KERNEL_DATA | PD_BLOCK;
+        }
+    }
+
+    pgd[0] = (uint64_t)pmd | PD_TABLE;
+    pgd[1] = LOCAL_PERIPHERAL_BASE | PD_DEVICE | PD_BLOCK;
+    for (int i = 2; i < PT_ENTRIES; i++) pgd[i] = 0;
+
+    mmu_enable();
+}
+
+/**
+ * mmu_enable - Load the identity map and set SCTLR_EL1.M/C/I
+ *
+ * Only the enable bits (and EL0 cache maintenance) are touched, the rest of
+ * SCTLR_EL1 is kept as set by the firmware.
+ */
+void mmu_enable() {
+    asm volatile("msr mair_el1, %0" : : "r"((unsigned long)MAIR_VALUE));
+    asm volatile("msr tcr_el1, %0" : : "r"((unsigned long)TCR_VALUE));
+    asm volatile("msr ttbr0_el1, %0" : : "r"(pgd));
+    asm volatile(
+        "dsb ish\n"
+        "tlbi vmalle1\n"
+        "dsb ish\n"
+        "isb\n"
+    );
+
+    unsigned long sctlr;
+    asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+    sctlr |= SCTLR_M | SCTLR_C | SCTLR_I | SCTLR_UCT | SCTLR_UCI;
+    asm volatile(
+        "msr sctlr_el1, %0\n"
+        "isb\n"
+        : : "r"(sctlr)
+    );
+}
+
+/**
+ * dcache_clean_invalidate_range - Write back and drop cached lines of a range
+ *
+ * The VideoCore does not snoop the ARM caches, so buffers shared with it
+ * (mailbox messages, the framebuffer) must be pushed to memory before the GPU
+ * reads them, and dropped before the CPU reads what the GPU wrote.
+ */
+void dcache_clean_invalidate_range(void *start, unsigned long size) {
+    unsigned long ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    unsigned long line = 4UL << ((ctr >> 16) & 0xF);  // DminLine, log2 of words
+
+    unsigned long addr = (unsigned long)start & ~(line - 1);
+    unsigned long end = (unsigned long)start + size;
+    for (; addr < end; addr += line) {
+        asm volatile("dc civac, %0" : : "r"(addr) : "memory");
+    }
+    asm volatile("dsb sy" : : : "memory");
+}
@@ -0,0 +1,98 @@
+#include "pid.h"
+#include "sched.h"
+
+/*
+ * Pid allocation and lookup.
+ *
+ * Pids in use are kept in a bitmap. A new pid is the first free one after
+ * the last pid handed out, wrapping around, so a pid is not reused right
+ * after its task was reaped. Tasks are found through a hash table of
+ * `PID_HASH_SIZE` buckets chained by `pid_next`, with at most `MAX_TASKS`
+ * tasks alive a lookup walks about one task.
+ */
+static uint64_t pid_map[PID_MAX / 64];
+static int last_pid = -1;
+static struct ThreadTask *pid_hash[PID_HASH_SIZE];
+static struct spinlock pid_lock;  // The bitmap, the table and `thread_cnt`
+
+static inline int pid_bucket(int pid) {
+    return pid & (PID_HASH_SIZE - 1);
+}
+
+// The first free pid after `last_pid`, -1 if every pid is taken
+static int pid_alloc() {
+    int pid = last_pid;
+    for (int i = 0; i < PID_MAX; i++) {
+        pid = pid + 1 < PID_MAX ? pid + 1 : 0;
+        if ((pid & 63) == 0 && pid_map[pid / 64] == ~0UL) {  // Skip a full word at once
+            pid += 63;
+            i += 63;
+            continue;
+        }
+        if (!(pid_map[pid / 64] & (1UL << (pid & 63)))) {
+            pid_map[pid / 64] |= 1UL << (pid & 63);
+            last_pid = pid;
+            return pid;
+        }
+    }
+    return -1;
+}
+
+/**
+ * task_register - Give a new task its pid and make it reachable by it
+ *
+ * @param task: A task not registered yet, its `id` is set
+ * @return 0 on success, -1 if there are `MAX_TASKS` tasks or no free pid
+ */
+int task_register(struct ThreadTask *task) {
+    unsigned long flags = irq_save();
+    spin_lock(&pid_lock);
+    int pid = thread_cnt < MAX_TASKS ? pid_alloc() : -1;
+    if (pid >= 0) {
+        task->id = pid;
+        task->pid_next = pid_hash[pid_bucket(pid)];
+        pid_hash[pid_bucket(pid)] = task;
+        thread_cnt++;
+    }
+    spin_unlock(&pid_lock);
+    irq_restore(flags);
+
+    if (pid < 0) {
+        uart_puts("[!] task_register: too many tasks or no free pid!\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Forget a reaped task, its pid can be handed out again
+void task_unregister(struct ThreadTask *task) {
+    unsigned long flags = irq_save();
+    spin_lock(&pid_lock);
+    struct ThreadTask **link = &pid_hash[pid_bucket(task->id)];
+    while (*link != NULL && *link != task) {
+        link = &(*link)->pid_next;
+    }
+    if (*link != NULL) {  // Registered
+        *link = task->pid_next;
+        task->pid_next = NULL;
+        pid_map[task->id / 64] &= ~(1UL << (task->id & 63));
+        thread_cnt--;
+    }
+    spin_unlock(&pid_lock);
+    irq_restore(flags);
+}
+
+// The task with this pid, in any state until it is reaped, NULL if there is none
+struct ThreadTask* task_lookup(int pid) {
+    if (pid < 0 || pid >= PID_MAX) return NULL;
+
+    unsigned long flags = irq_save();
+    spin_lock(&pid_lock);
+    struct ThreadTask *task = pid_hash[pid_bucket(pid)];
+    while (task != NULL && task->id != pid) {
+        task = task->pid_next;
+    }
+    spin_unlock(&pid_lock);
+    irq_restore(flags);
+    return task;
+}
@@ -1,11 +1,14 @@
 #include "sched.h"
 
-struct ThreadTask *ready_queue = NULL;
-struct ThreadTask *wait_queue = NULL;
-struct ThreadTask *zombie_queue = NULL;
+struct run_queue run_queues[NR_CPUS];
+
+_Static_assert(offsetof(struct ThreadTask, on_cpu) == 8 * 13, "cpu_switch_to clears on_cpu at this offset");
 
 unsigned int thread_cnt = 0;
 
+static struct kmem_cache *task_cache = NULL;
+static struct kmem_cache *sig_frame_cache = NULL;
+
 void print_queue(struct ThreadTask *queue) {
     struct ThreadTask *current = queue;
     while (current != NULL) {
@@ -68,51 +71,506 @@ void rm_thread_task(struct ThreadTask **queue, struct ThreadTask *task) {
     }
 }
 
+static inline unsigned int prio_bit(int level) {
+    return 1U << (NR_PRIO - 1 - level);
+}
+
+static void prio_array_init(struct prio_array *array) {
+    array->bitmap = 0;
+    array->nr_tasks = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        array->nr_movable[cpu] = 0;
+    }
+    for (int i = 0; i < NR_PRIO; i++) {
+        array->head[i] = NULL;
+        array->tail[i] = NULL;
+    }
+}
+
+// Count the task in or out of `nr_movable` for each core of its affinity
+static void prio_array_account(struct prio_array *array, struct ThreadTask *task, int delta) {
+    if (task->priority == IDLE_PRIORITY) return;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (task->cpus_allowed & (1U << cpu)) array->nr_movable[cpu] += delta;
+    }
+}
+
+// Append the task at the tail of its level
+static void prio_array_add(struct prio_array *array, struct ThreadTask *task) {
+    int level = task->priority;
+    task->next = NULL;
+    if (array->tail[level] == NULL) {
+        array->head[level] = task;
+        array->bitmap |= prio_bit(level);
+    }
+    else {
+        array->tail[level]->next = task;
+    }
+    array->tail[level] = task;
+    array->nr_tasks++;
+    prio_array_account(array, task, 1);
+}
+
+// Take the first task of the most urgent level, NULL if the array is empty
+static struct ThreadTask* prio_array_pop(struct prio_array *array) {
+    if (array->bitmap == 0) return NULL;
+
+    int level = __builtin_clz(array->bitmap);
+    struct ThreadTask *task = array->head[level];
+    array->head[level] = task->next;
+    if (array->head[level] == NULL) {
+        array->tail[level] = NULL;
+        array->bitmap &= ~prio_bit(level);
+    }
+    task->next = NULL;
+    array->nr_tasks--;
+    prio_array_account(array, task, -1);
+    return task;
+}
+
+// Unlink the task from its level, return 1 if it was there
+static int prio_array_remove(struct prio_array *array, struct ThreadTask *task) {
+    int level = task->priority;
+    struct ThreadTask *prev = NULL;
+    struct ThreadTask *current = array->head[level];
+    while (current != NULL && current != task) {
+        prev = current;
+        current = current->next;
+    }
+    if (current == NULL) return 0;
+
+    if (prev == NULL) array->head[level] = task->next;
+    else prev->next = task->next;
+    if (array->tail[level] == task) array->tail[level] = prev;
+    if (array->head[level] == NULL) array->bitmap &= ~prio_bit(level);
+    task->next = NULL;
+    array->nr_tasks--;
+    prio_array_account(array, task, -1);
+    return 1;
+}
+
+static inline struct run_queue* this_rq() {
+    return &run_queues[cpu_id()];
+}
+
+static inline struct run_queue* task_rq(struct ThreadTask *task) {
+    return &run_queues[task->cpu];
+}
+
+// Lock a run queue with IRQs masked, return the mask for `rq_unlock`
+static unsigned long rq_lock(struct run_queue *rq) {
+    unsigned long flags = irq_save();
+    spin_lock(&rq->lock);
+    return flags;
+}
+
+static void rq_unlock(struct run_queue *rq, unsigned long flags) {
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+// Lock the run queue of the task, which may move to another core until its queue is locked
+static struct run_queue* task_rq_lock(struct ThreadTask *task, unsigned long *flags) {
+    while (1) {
+        struct run_queue *rq = task_rq(task);
+        *flags = rq_lock(rq);
+        if (rq == task_rq(task)) return rq;
+        rq_unlock(rq, *flags);
+    }
+}
+
+// Lock two run queues, the lower core first so that two cores balancing cannot deadlock
+static unsigned long double_rq_lock(struct run_queue *a, struct run_queue *b) {
+    unsigned long flags = irq_save();
+    if (a > b) {
+        struct run_queue *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    spin_lock(&a->lock);
+    spin_lock(&b->lock);
+    return flags;
+}
+
+static void double_rq_unlock(struct run_queue *a, struct run_queue *b, unsigned long flags) {
+    spin_unlock(&a->lock);
+    spin_unlock(&b->lock);
+    irq_restore(flags);
+}
+
+static void rq_enqueue(struct run_queue *rq, struct ThreadTask *task) {
+    if (task->counter > 0) {
+        prio_array_add(rq->active, task);
+    }
+    else {
+        task->counter = PRIO_TIMESLICE(task->priority);
+        prio_array_add(rq->expired, task);
+    }
+}
+
+static int rq_dequeue(struct run_queue *rq, struct ThreadTask *task) {
+    return prio_array_remove(rq->active, task) || prio_array_remove(rq->expired, task);
+}
+
+/*
+ * Wake a core sleeping in `idle_wait` after queuing work on `cpu`: `cpu`
+ * itself, or else another core of `allowed`, the affinity of the work, which
+ * steals it. The barrier pairs with the one in `idle_wait`: either the
+ * sleeper sees the queued task, or this core sees it sleeping.
+ */
+static void kick_idle(int cpu, unsigned int allowed) {
+    smp_mb();
+    if (run_queues[cpu].sleeping) {
+        smp_send_wakeup(cpu);
+        return;
+    }
+    for (int i = 0; i < NR_CPUS; i++) {
+        if ((allowed & (1U << i)) && run_queues[i].sleeping) {
+            smp_send_wakeup(i);
+            return;
+        }
+    }
+}
+
+/**
+ * sched_enqueue - Make a task ready to run
+ *
+ * The task joins the run queue of its core. A task with time left in its
+ * slice joins the tail of its level in the active array. A task that used up
+ * its slice gets a new one and waits in the expired array for the next round.
+ * A core sleeping in the idle loop is woken up to run it.
+ *
+ * @param task: A task in no queue, its `priority` below `NR_PRIO`
+ */
+void sched_enqueue(struct ThreadTask *task) {
+    unsigned long flags;
+    struct run_queue *rq = task_rq_lock(task, &flags);
+    rq_enqueue(rq, task);
+    int cpu = task->cpu;
+    unsigned int allowed = task->cpus_allowed;
+    rq_unlock(rq, flags);
+    kick_idle(cpu, allowed);
+}
+
+// Take a ready task out of the run queue, return 1 if it was there
+int sched_dequeue(struct ThreadTask *task) {
+    unsigned long flags;
+    struct run_queue *rq = task_rq_lock(task, &flags);
+    int queued = rq_dequeue(rq, task);
+    rq_unlock(rq, flags);
+    return queued;
+}
+
+// The next task to run, starting a new round when the active array is empty
+static struct ThreadTask* sched_pick(struct run_queue *rq) {
+    if (rq->active->nr_tasks == 0) {
+        struct prio_array *tmp = rq->active;
+        rq->active = rq->expired;
+        rq->expired = tmp;
+    }
+    return prio_array_pop(rq->active);
+}
+
+// Queued tasks, the idle tasks aside
+static int rq_queued(struct run_queue *rq) {
+    int idle = 0;
+    for (int i = 0; i < 2; i++) {
+        for (struct ThreadTask *task = rq->arrays[i].head[IDLE_PRIORITY]; task != NULL; task = task->next) {
+            idle++;
+        }
+    }
+    return rq->arrays[0].nr_tasks + rq->arrays[1].nr_tasks - idle;
+}
+
+// Tasks that keep the core busy: the queued ones and the running one, the idle tasks aside
+static int rq_load(struct run_queue *rq) {
+    return rq_queued(rq) + rq->busy;
+}
+
+// Queued tasks that may move to core `cpu`, a hint when `rq` is not locked
+static int rq_movable(struct run_queue *rq, int cpu) {
+    return rq->arrays[0].nr_movable[cpu] + rq->arrays[1].nr_movable[cpu];
+}
+
+// Unlink the first task of the most urgent level that may move to core `cpu`, NULL if there is none
+static struct ThreadTask* prio_array_steal(struct prio_array *array, int cpu) {
+    unsigned int bitmap = array->bitmap & ~prio_bit(IDLE_PRIORITY);
+    while (bitmap != 0) {
+        int level = __builtin_clz(bitmap);
+        for (struct ThreadTask *task = array->head[level]; task != NULL; task = task->next) {
+            if (!(task->cpus_allowed & (1U << cpu))) continue;
+            if (!load_acquire(&task->on_cpu)) {  // Not the task its core is just switching out
+                prio_array_remove(array, task);
+                return task;
+            }
+        }
+        bitmap &= ~prio_bit(level);
+    }
+    return NULL;
+}
+
+/*
+ * Move a queued task from `src` to `dst`, both locked, return 1 if a task
+ * moved. The expired tasks go first: they wait for the next round on `src`
+ * anyway, and their caches are the coldest.
+ */
+static int rq_migrate(struct run_queue *src, struct run_queue *dst) {
+    int cpu = dst - run_queues;
+    struct ThreadTask *task = prio_array_steal(src->expired, cpu);
+    if (task == NULL) task = prio_array_steal(src->active, cpu);
+    if (task == NULL) return 0;
+
+    task->cpu = cpu;
+    rq_enqueue(dst, task);
+    src->migrate_out_cnt++;
+    return 1;
+}
+
+// The online core other than `self` with the most queued tasks that may move to `self`, -1 if none has any
+static int find_busiest(int self) {
+    int busiest = -1, busiest_queued = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (cpu == self || !cpu_online(cpu)) continue;
+        int queued = rq_movable(&run_queues[cpu], self);  // Unlocked, only a hint
+        if (queued > busiest_queued) {
+            busiest = cpu;
+            busiest_queued = queued;
+        }
+    }
+    return busiest;
+}
+
+/**
+ * sched_steal - Take a task from the busiest core when this one has no work
+ *
+ * Called from the idle loop of every core. Thieves only lock the two queues
+ * involved, and a task is never taken before its core saved its registers.
+ *
+ * @return 1 if a task was stolen, 0 otherwise
+ */
+int sched_steal() {
+    int self = cpu_id();
+    struct run_queue *rq = &run_queues[self];
+    if (rq_load(rq) > 0) return 0;
+
+    int busiest = find_busiest(self);
+    if (busiest < 0) return 0;
+
+    struct run_queue *src = &run_queues[busiest];
+    unsigned long flags = double_rq_lock(rq, src);
+    int stolen = rq_load(rq) == 0 && rq_migrate(src, rq);
+    if (stolen) rq->steal_cnt++;
+    double_rq_unlock(rq, src, flags);
+    return stolen;
+}
+
+/**
+ * sched_balance - Even out the load of the busiest and the least loaded core
+ *
+ * Called every `BALANCE_INTERVAL` scheduler ticks from `core_timer_handler`,
+ * it catches cores that are busy but unevenly so, which stealing alone
+ * leaves as they are. Tasks move until the two loads differ by at most one.
+ */
+void sched_balance() {
+    int busiest = -1, idlest = -1;
+    int busiest_load = 0, idlest_load = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!cpu_online(cpu)) continue;
+        int load = rq_load(&run_queues[cpu]);
+        if (busiest < 0 || load > busiest_load) {
+            busiest = cpu;
+            busiest_load = load;
+        }
+        if (idlest < 0 || load < idlest_load) {
+            idlest = cpu;
+            idlest_load = load;
+        }
+    }
+    if (busiest_load - idlest_load < 2) return;
+
+    struct run_queue *src = &run_queues[busiest], *dst = &run_queues[idlest];
+    if (rq_movable(src, idlest) == 0) return;  // Pinned elsewhere, not worth the locks
+
+    int moved = 0;
+    unsigned long flags = double_rq_lock(src, dst);
+    while (rq_load(src) - rq_load(dst) >= 2 && rq_migrate(src, dst)) {
+        dst->balance_in_cnt++;
+        moved++;
+    }
+    double_rq_unlock(src, dst, flags);
+    if (moved) kick_idle(idlest, 1U << idlest);
+}
+
+// Per core: the load, running and queued tasks but the idle ones, and the migrations since boot
+void print_sched_stats() {
+    uart_puts("cpu online load stolen balanced_in migrated_out sleeps\r\n");
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        struct run_queue *rq = &run_queues[cpu];
+        uart_puts(itoa(cpu));
+        uart_puts(" ");
+        uart_puts(cpu_online(cpu) ? "yes" : "no");
+        uart_puts(" ");
+        uart_puts(itoa(rq_load(rq)));
+        uart_puts(" ");
+        uart_puts(itoa(rq->steal_cnt));
+        uart_puts(" ");
+        uart_puts(itoa(rq->balance_in_cnt));
+        uart_puts(" ");
+        uart_puts(itoa(rq->migrate_out_cnt));
+        uart_puts(" ");
+        uart_puts(itoa(rq->sleep_cnt));
+        uart_puts("\r\n");
+    }
+}
+
+// Every run queue is set up here, before the secondary cores are released
 void sched_init() {
-    ready_queue = NULL;
-    wait_queue = NULL;
-    zombie_queue = NULL;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        struct run_queue *rq = &run_queues[cpu];
+        prio_array_init(&rq->arrays[0]);
+        prio_array_init(&rq->arrays[1]);
+        rq->active = &rq->arrays[0];
+        rq->expired = &rq->arrays[1];
+        rq->blocked = NULL;
+        rq->zombies = NULL;
+        rq->busy = 0;
+        rq->sleeping = 0;
+        rq->sleep_cnt = 0;
+        rq->steal_cnt = 0;
+        rq->balance_in_cnt = 0;
+        rq->migrate_out_cnt = 0;
+    }
     thread_cnt = 0;
 
+    task_cache = kmem_cache_create("task", sizeof(struct ThreadTask), 0, NULL);
+    sig_frame_cache = kmem_cache_create("sig_frame", sizeof(struct TrapFrame), 16, NULL);
+    stack_pool_init();
+
     // Create a task for "idle"
-    struct ThreadTask *idle_task = (struct ThreadTask *)alloc(sizeof(struct ThreadTask));
+    struct ThreadTask *idle_task = (struct ThreadTask *)kmem_cache_alloc(task_cache);
     if (idle_task == NULL) {
         uart_puts("Failed to allocate memory for idle task!\n");
         return;
     }
+    memset(idle_task, 0, sizeof(struct ThreadTask));  // Slab memory, `on_cpu` and the links must start cleared
 
-    thread_create(idle);
+    idle_task->priority = IDLE_PRIORITY;
+    idle_task->counter = PRIO_TIMESLICE(IDLE_PRIORITY);
+
+    struct ThreadTask *idle_thread = thread_create(idle);
+    if (idle_thread != NULL) {
+        sched_dequeue(idle_thread);
+        idle_thread->priority = IDLE_PRIORITY;  // Runs when the other tasks yield or used up their slices
+        idle_thread->counter = PRIO_TIMESLICE(IDLE_PRIORITY);
+        sched_enqueue(idle_thread);
+    }
+    idle_task->preempt_count = 1;
+    idle_task->cpu = 0;
+    idle_task->cpus_allowed = 1U << 0;
+    idle_task->cwd = rootfs->root;
     set_current(idle_task);
     idle_task->state = TASK_RUNNING;
 }
 
+/**
+ * sched_init_secondary - Make the boot context of a secondary core its idle task
+ *
+ * The idle task has no pid and no stacks of its own, it runs on the boot
+ * stack of the core and is never reaped.
+ *
+ * @return 0 on success, -1 if there is not enough memory
+ */
+int sched_init_secondary() {
+    struct ThreadTask *idle_task = (struct ThreadTask *)kmem_cache_alloc(task_cache);
+    if (idle_task == NULL) {
+        return -1;
+    }
+
+    memset(idle_task, 0, sizeof(struct ThreadTask));
+    idle_task->state = TASK_RUNNING;
+    idle_task->priority = IDLE_PRIORITY;
+    idle_task->counter = PRIO_TIMESLICE(IDLE_PRIORITY);
+    idle_task->preempt_count = 1;
+    idle_task->cpu = cpu_id();
+    idle_task->cpus_allowed = 1U << cpu_id();
+    idle_task->cwd = rootfs->root;
+    set_current(idle_task);
+    return 0;
+}
+
+// Kernel stack then user stack, the user stack is last so that it can be a clean one
+static int task_alloc_stacks(int zero_stack, void **pages) {
+    int dirty = zero_stack ? TASK_PAGES - 1 : TASK_PAGES;
+    if (stack_alloc(pages, dirty)) {
+        return -1;
+    }
+    if (zero_stack) {
+        pages[TASK_PAGES - 1] = stack_alloc_clean();
+        if (pages[TASK_PAGES - 1] == NULL) {
+            stack_free(pages, dirty);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * task_alloc - Allocate a task with its stacks and signal frame
+ *
+ * The task and its signal frame come from their slab caches. The `TASK_PAGES`
+ * stacks come from the stack pool, which `kill_zombies` refills with the
+ * stacks of exited tasks, so fork/exit churn mostly bypasses the page
+ * allocator. The task gets its pid here, and stays registered until it is
+ * reaped.
+ *
+ * @param zero_stack: Give the task a clean user stack, fork copies the parent
+ *                    stack over it and passes 0
+ * @return The task, NULL if there is not enough memory
+ */
+struct ThreadTask* task_alloc(int zero_stack) {
+    struct ThreadTask *task = (struct ThreadTask *)kmem_cache_alloc(task_cache);
+    if (task == NULL) {
+        return NULL;
+    }
+    task->sig_frame = (struct TrapFrame *)kmem_cache_alloc(sig_frame_cache);
+    if (task->sig_frame == NULL) {
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+
+    void *pages[TASK_PAGES];
+    if (task_alloc_stacks(zero_stack, pages)) {
+        kmem_cache_free(sig_frame_cache, task->sig_frame);
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+    if (task_register(task)) {
+        stack_free(pages, TASK_PAGES);
+        kmem_cache_free(sig_frame_cache, task->sig_frame);
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+    task->kernel_stack = pages[0];
+    task->user_stack = pages[1];
+    task->cpu = cpu_id();
+    task->cpus_allowed = CPU_MASK_ALL;
+    task->on_cpu = 0;
+    return task;
+}
+
 struct ThreadTask* thread_create(void (*callback)(void)) {
     // Allocate memory for the task
-    struct ThreadTask *task = (struct ThreadTask *)alloc(sizeof(struct ThreadTask));
+    struct ThreadTask *task = task_alloc(1);
     if (task == NULL) {
         uart_puts("Failed to allocate memory for task!\n");
         return -1;
     }
 
     // Initialize the task
-    task->id = thread_cnt++;
     task->state = TASK_READY;
-    task->counter = DEFAULT_PRIORITY;
     task->priority = DEFAULT_PRIORITY;
+    task->counter = PRIO_TIMESLICE(DEFAULT_PRIORITY);
     task->preempt_count = 1;
-    task->kernel_stack = alloc(THREAD_STACK_SIZE);
-    if (task->kernel_stack == NULL) {
-        uart_puts("Failed to allocate memory for task stack!\n");
-        free(task);
-        return -1;
-    }
-    task->user_stack = alloc(THREAD_STACK_SIZE);
-    if (task->user_stack == NULL) {
-        uart_puts("Failed to allocate memory for task stack!\n");
-        free(task->kernel_stack);
-        free(task);
-        return -1;
-    }
 
     // Initialize signal handling
     task->pending_sig = 0;
@@ -120,7 +578,6 @@ struct ThreadTask* thread_create(void (*callback)(void)) {
         if (i == SIGKILL) task->sig_handlers[i] = default_sigkill_handler;
         else task->sig_handlers[i] = default_handler;
     }
-    task->sig_frame = (struct TrapFrame *)alloc(sizeof(struct TrapFrame));
     task->next = NULL;
 
     // Initialize file system operations
@@ -139,78 +596,169 @@ struct ThreadTask* thread_create(void (*callback)(void)) {
     task->cpu_context.sp = (unsigned long)task->user_stack + THREAD_STACK_SIZE;
     task->cpu_context.fp = task->cpu_context.sp;
 
-    // Add the task to the ready queue
-    add_thread_task(&ready_queue, task);
+    sched_enqueue(task);
 
     return task;
 }
 
+// Any task that is not reaped yet: ready, running, blocked or exited
 struct ThreadTask* get_thread_task_by_id(int pid) {
-    struct ThreadTask *current = ready_queue;
-    while (current != NULL) {
-        if (current->id == pid) {
-            return current;
-        }
-        current = current->next;
-    }
-
-    current = wait_queue;
-    while (current != NULL) {
-        if (current->id == pid) {
-            return current;
-        }
-        current = current->next;
-    }
-    
-    return NULL;
+    return task_lookup(pid);
 }
 
 void _exit() {
     struct ThreadTask *curr = get_current();
     if (curr == NULL) return;
 
-    rm_thread_task(&ready_queue, curr);
-    rm_thread_task(&wait_queue, curr);
-
     curr->state = TASK_EXITED;
 
-    schedule();  // Switch to the next task
+    schedule();  // Switch to the next task, this one goes to the zombies of its core
 }
 
+/**
+ * _kill - Make a task exit
+ *
+ * A queued or blocked task goes to the zombies of its core at once. A task
+ * running on another core is only marked, its core switches it out at the
+ * next scheduler tick.
+ *
+ * @param pid: The task, the current task included
+ * @return 0 on success, -1 if there is no such task or it already exited
+ */
 int _kill(unsigned int pid) {
     struct ThreadTask *task = get_thread_task_by_id(pid);
-    if (task == NULL) {
+    unsigned long flags = 0;
+    struct run_queue *rq = task != NULL ? task_rq_lock(task, &flags) : NULL;
+    if (task == NULL || task->state == TASK_EXITED) {
+        if (rq != NULL) rq_unlock(rq, flags);
         uart_puts("[WARN] _kill: no running task with pid ");
         uart_puts(itoa(pid));
         uart_puts("\r\n");
         return -1;
     }
 
-    rm_thread_task(&ready_queue, task);
-    rm_thread_task(&wait_queue, task);
-
+    int running = task->state == TASK_RUNNING;
+    if (task->state == TASK_READY) rq_dequeue(rq, task);
+    else if (task->state == TASK_BLOCKED) rm_thread_task(&rq->blocked, task);
     task->state = TASK_EXITED;
+    if (!running) add_thread_task(&rq->zombies, task);
+    rq_unlock(rq, flags);
 
-    struct ThreadTask *curr = get_current();
-    if (curr == task) schedule();
-    else add_thread_task(&zombie_queue, task);
+    if (task == get_current()) schedule();
+    return 0;
+}
+
+/**
+ * sched_set_priority - Move a task to another priority level
+ *
+ * A queued task moves to the tail of its new level, the running task keeps
+ * running until it is queued again.
+ *
+ * @param pid: The task, the current task included
+ * @param priority: From 0, the most urgent, to `IDLE_PRIORITY`
+ * @return 0 on success, -1 if there is no such task or the priority is invalid
+ */
+int sched_set_priority(unsigned int pid, int priority) {
+    if (priority < 0 || priority >= NR_PRIO) return -1;
+
+    struct ThreadTask *task = get_thread_task_by_id(pid);
+    if (task == NULL) return -1;
+
+    unsigned long flags;
+    struct run_queue *rq = task_rq_lock(task, &flags);
+    int queued = rq_dequeue(rq, task);
+    task->priority = priority;
+    if (task->counter > PRIO_TIMESLICE(priority)) task->counter = PRIO_TIMESLICE(priority);
+    if (queued) rq_enqueue(rq, task);
+    rq_unlock(rq, flags);
+    return 0;
+}
+
+/**
+ * sched_set_affinity - Choose the cores a task may be moved to
+ *
+ * Stealing and balancing only move a task to a core of its mask. A queued
+ * task on a core outside the new mask moves to the first online core of it at
+ * once; a running or blocked one stays where it is until a core of its mask
+ * takes it.
+ *
+ * @param pid: The task, the current task included
+ * @param mask: Bit per core, `CPU_MASK_ALL` for any core
+ * @return 0 on success, -1 if there is no such task or no core of the mask is online
+ */
+int sched_set_affinity(unsigned int pid, unsigned int mask) {
+    int dst_cpu = -1;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        if ((mask & (1U << cpu)) && cpu_online(cpu)) {
+            dst_cpu = cpu;
+            break;
+        }
+    }
+    if (dst_cpu < 0) return -1;
 
+    struct ThreadTask *task = get_thread_task_by_id(pid);
+    if (task == NULL) return -1;
+
+    unsigned long flags;
+    struct run_queue *rq = task_rq_lock(task, &flags);
+    int queued = rq_dequeue(rq, task);  // Queued again under its new mask, for `nr_movable`
+    task->cpus_allowed = mask & CPU_MASK_ALL;
+    if (queued) rq_enqueue(rq, task);
+    int stays = task->state != TASK_READY || (mask & (1U << task->cpu));
+    rq_unlock(rq, flags);
+    if (stays) return 0;
+
+    struct run_queue *dst = &run_queues[dst_cpu];
+    flags = double_rq_lock(rq, dst);
+    // Rechecked under both locks: the task may have run or been stolen meanwhile
+    int moves = task_rq(task) == rq && !load_acquire(&task->on_cpu) && rq_dequeue(rq, task);
+    if (moves) {
+        task->cpu = dst_cpu;
+        rq_enqueue(dst, task);
+        rq->migrate_out_cnt++;
+    }
+    double_rq_unlock(rq, dst, flags);
+    if (moves) kick_idle(dst_cpu, mask);
     return 0;
 }
 
+/**
+ * sched_tick - Charge a scheduler tick to the running task
+ *
+ * @return 1 if the task should be switched out: its slice is used up, a
+ *         more urgent task is ready on this core, or another core killed it
+ */
+int sched_tick() {
+    struct ThreadTask *curr = get_current();
+    if (curr == NULL || curr->state == TASK_EXITED) return 1;
+    if (--curr->counter <= 0) return 1;
+
+    unsigned int bitmap = this_rq()->active->bitmap;
+    return bitmap != 0 && __builtin_clz(bitmap) < curr->priority;
+}
+
+// Switch to the next task of the run queue of this core
 void schedule() {
     disable_irq_el1();
     timer_disable_irq();
 
+    struct run_queue *rq = this_rq();
+    spin_lock(&rq->lock);
+
     struct ThreadTask *prev = get_current();
     if (prev == NULL) {
-        ready_queue->state = TASK_RUNNING;
-        set_current(ready_queue);
+        struct ThreadTask *next = sched_pick(rq);
+        if (next != NULL) {
+            next->state = TASK_RUNNING;
+            rq->busy = next->priority != IDLE_PRIORITY;
+            set_current(next);
+        }
+        spin_unlock(&rq->lock);
     }
     else {
-        struct ThreadTask *next = ready_queue;
-
-        if (next == NULL || next == prev) {
+        if (rq->active->nr_tasks + rq->expired->nr_tasks == 0) {
+            if (prev->counter <= 0) prev->counter = PRIO_TIMESLICE(prev->priority);  // Alone, it starts a new slice
+            spin_unlock(&rq->lock);
             enable_irq_el1();
             timer_enable_irq();
             return;
@@ -218,27 +766,34 @@ void schedule() {
 
         if (prev->state == TASK_RUNNING) {
             prev->state = TASK_READY;
-            add_thread_task(&ready_queue, prev);
+            prev->on_cpu = 1;  // Until `cpu_switch_to` saved its registers, no other core may take it
+            rq_enqueue(rq, prev);
         }
         else if (prev->state == TASK_BLOCKED) {
-            add_thread_task(&wait_queue, prev);
+            add_thread_task(&rq->blocked, prev);
         }
         else if (prev->state == TASK_EXITED) {
-            add_thread_task(&zombie_queue, prev);
+            add_thread_task(&rq->zombies, prev);
         }
         else if (prev->state == TASK_READY);
         else {
+            spin_unlock(&rq->lock);
             uart_puts("Invalid thread state!\n");
             enable_irq_el1();
             timer_enable_irq();
             return;
         }
 
-        // print_queue(ready_queue);
-
         // Switch to the next task
+        struct ThreadTask *next = sched_pick(rq);
         next->state = TASK_RUNNING;
-        next = pop_thread_task(&ready_queue);
+        rq->busy = next->priority != IDLE_PRIORITY;
+        spin_unlock(&rq->lock);
+        if (next == prev) {  // Still the most urgent one
+            enable_irq_el1();
+            timer_enable_irq();
+            return;
+        }
 
         // enable_irq_el1();
         timer_enable_irq();
@@ -251,19 +806,65 @@ void schedule() {
     return;
 }
 
+// Release every task that exited on this core, the stacks go back to the stack pool in batches
 void kill_zombies() {
-    struct ThreadTask *zombie = pop_thread_task(&zombie_queue);
+    void *pages[MAX_BULK];
+    int cnt = 0;
+
+    struct run_queue *rq = this_rq();
+    unsigned long flags = rq_lock(rq);
+    struct ThreadTask *zombies = rq->zombies;
+    rq->zombies = NULL;
+    rq_unlock(rq, flags);
+
+    struct ThreadTask *zombie = pop_thread_task(&zombies);
     while (zombie != NULL) {
-        free(zombie->kernel_stack);
-        free(zombie->user_stack);
-        free(zombie);
-        zombie = pop_thread_task(&zombie_queue);
+        pages[cnt++] = zombie->kernel_stack;
+        pages[cnt++] = zombie->user_stack;
+        task_unregister(zombie);
+        kmem_cache_free(sig_frame_cache, zombie->sig_frame);
+        kmem_cache_free(task_cache, zombie);
+        zombie = pop_thread_task(&zombies);
+
+        if (cnt + TASK_PAGES > MAX_BULK || zombie == NULL) {
+            stack_free(pages, cnt);
+            cnt = 0;
+        }
+    }
+}
+
+/*
+ * Sleep in `wfi` until an interrupt while this core has nothing to run and no
+ * other core has work it may steal: tasks pinned elsewhere do not keep it
+ * awake, see `find_busiest`. The scheduler tick is stopped meanwhile, the
+ * core wakes up for a due timer of core 0, the UART, or a wake-up from a core
+ * that queued work. IRQs stay masked across `wfi`, a pending one still ends
+ * it and is taken once they are restored.
+ */
+static void idle_wait() {
+    struct run_queue *rq = this_rq();
+    unsigned long flags = irq_save();
+    rq->sleeping = 1;
+    smp_mb();  // Pairs with `kick_idle`
+    if (rq_load(rq) == 0 && rq->zombies == NULL && find_busiest(cpu_id()) < 0) {
+        rq->sleep_cnt++;
+        tick_stop();
+        wait_for_irq();
+        tick_restart();
     }
+    rq->sleeping = 0;
+    irq_restore(flags);
 }
 
 void idle() {
     while (1) {
         kill_zombies();
+        // Below the low watermark, give cached memory back before it is needed.
+        // One core is enough, and `mm_reclaim` keeps its rate limit without a lock
+        if (cpu_id() == 0) mm_reclaim();
+        int busy = zero_pool_fill(ZERO_FILL_BATCH);  // Nothing else to run, zero pages for the next stacks
+        busy |= sched_steal();                       // Or take work from the busiest core
+        if (!busy) idle_wait();
         schedule();
     }
 }
\ No newline at end of file
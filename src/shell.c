@@ -11,6 +11,11 @@ void cmd_help_msg() {
     uart_puts("test_alloc :test memory allocation\r\n");
     uart_puts("setTimeout : set a timeout and print a msg\r\n");
     uart_puts("memAlloc   :allocate memory\r\n");
+    uart_puts("meminfo    :print allocator statistics [pcp <order> <high>]\r\n");
+    uart_puts("allocprof  :print allocation sites [bytes|rate|reset]\r\n");
+    uart_puts("nice       :set the priority of a task <pid> <priority>\r\n");
+    uart_puts("taskset    :set the cores a task may move to <pid> <mask>\r\n");
+    uart_puts("sched      :print the run queue and task migrations of each core\r\n");
     uart_puts("reboot     :reboot the system\r\n");
     return;
 }
@@ -37,22 +42,14 @@ void cmd_mbox() {
     }
 
     /* Get Arm memory */
-    mbox[0] = 8 * 4;
-    mbox[1] = REQUEST_CODE;
-    mbox[2] = GET_ARM_MEMORY;
-    mbox[3] = 8;
-    mbox[4] = TAG_REQUEST_CODE;
-    mbox[5] = 0; // base address
-    mbox[6] = 0; // size
-    mbox[7] = END_TAG;
-    
-    ret = mailbox_call(mbox, 8);
+    unsigned int mem_base, mem_size;
+    ret = mailbox_get_arm_memory(&mem_base, &mem_size);
     if (ret) {
         uart_puts("ARM memory base address: ");
-        uart_hex(mbox[5]);
+        uart_hex(mem_base);
         uart_puts("\r\n");
         uart_puts("ARM memory size: ");
-        uart_hex(mbox[6]);
+        uart_hex(mem_size);
         uart_puts("\r\n");
     }
 }
@@ -187,6 +184,55 @@ void shell() {
                 uart_puts("\r\n");
             }
         }
+        else if (strcmp(cmd_name, "meminfo") == 0) {
+            if (cmd.argc == 0) {
+                print_meminfo();
+            }
+            else if (cmd.argc == 3 && strcmp(cmd.args[0], "pcp") == 0) {
+                if (pcp_set_high(atoi(cmd.args[1]), atoi(cmd.args[2]))) {
+                    uart_puts("No hot page cache below order ");
+                    uart_puts(itoa(PCP_ORDERS));
+                    uart_puts(", or the watermark is negative\r\n");
+                }
+            }
+            else {
+                uart_puts("Usage: meminfo [pcp <order> <high>], a watermark of 0 disables the cache\r\n");
+            }
+        }
+        else if (strcmp(cmd_name, "allocprof") == 0) {
+            if (cmd.argc > 0 && strcmp(cmd.args[0], "reset") == 0) {
+                alloc_profile_reset();
+            }
+            else if (cmd.argc > 0 && strcmp(cmd.args[0], "rate") == 0) {
+                print_alloc_profile(ALLOC_PROFILE_BY_RATE);
+            }
+            else {
+                print_alloc_profile(ALLOC_PROFILE_BY_BYTES);
+            }
+        }
+        else if (strcmp(cmd_name, "nice") == 0) {
+            if (cmd.argc != 2) {
+                uart_puts("Usage: nice <pid> <priority>, 0 is the most urgent\r\n");
+                continue;
+            }
+            if (sched_set_priority(atoi(cmd.args[0]), atoi(cmd.args[1]))) {
+                uart_puts("No such task, or the priority is not below ");
+                uart_puts(itoa(NR_PRIO));
+                uart_puts("\r\n");
+            }
+        }
+        else if (strcmp(cmd_name, "taskset") == 0) {
+            if (cmd.argc != 2) {
+                uart_puts("Usage: taskset <pid> <mask>, bit n for core n\r\n");
+                continue;
+            }
+            if (sched_set_affinity(atoi(cmd.args[0]), atoi(cmd.args[1]))) {
+                uart_puts("No such task, or no core of the mask is online\r\n");
+            }
+        }
+        else if (strcmp(cmd_name, "sched") == 0) {
+            print_sched_stats();
+        }
         else if (strcmp(cmd_name, "reboot") == 0) {
             uart_puts("Rebooting...\r\n");
             reset(100);
@@ -1,13 +1,30 @@
 #include "signal.h"
 
+// `pending_sig` of every task, set from the core of the sender and cleared on the core of the receiver
+static struct spinlock signal_lock;
+
+// Mark `sig` pending for `task`, it is handled on the next return to EL0 of the task
+void signal_raise(struct ThreadTask *task, int sig) {
+    unsigned long flags = irq_save();
+    spin_lock(&signal_lock);
+    task->pending_sig |= (1 << sig);
+    spin_unlock(&signal_lock);
+    irq_restore(flags);
+}
+
 void check_pending_signals(struct ThreadTask *task, struct TrapFrame *trapframe) {
     if (task->pending_sig == 0) {
         return;  // No pending signals
     }
     
     for (int sig = 0; sig < SIG_NUM; sig++) {
-        if (task->pending_sig & (1 << sig)) {
-            task->pending_sig &= ~(1 << sig);  // Clear the signal
+        unsigned long flags = irq_save();
+        spin_lock(&signal_lock);
+        int pending = task->pending_sig & (1 << sig);
+        task->pending_sig &= ~(1 << sig);  // Clear the signal
+        spin_unlock(&signal_lock);
+        irq_restore(flags);
+        if (pending) {
             handle_signal(task, sig, trapframe);
         }
     }
@@ -42,7 +59,7 @@ void handle_signal(struct ThreadTask *task, int sig, struct TrapFrame *trapframe
     else {
         // Custom handler, switch to user mode
         uart_puts("[INFO] handle_signal: using custom handler\r\n");
-        memcpy(&task->sig_frame, trapframe, sizeof(struct TrapFrame));
+        memcpy(task->sig_frame, trapframe, sizeof(struct TrapFrame));
 
         task->cpu_context.sp = alloc(THREAD_STACK_SIZE) + THREAD_STACK_SIZE;
         task->cpu_context.fp = task->cpu_context.sp;
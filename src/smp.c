@@ -0,0 +1,77 @@
+#include "smp.h"
+#include "sched.h"
+#include "timer.h"
+#include "mmu.h"
+#include "uart.h"
+#include "utils.h"
+
+/*
+ * Bring-up of the secondary cores.
+ *
+ * The firmware parks cores 1-3 with the MMU off, each polling its release
+ * address in the spin table at `SPIN_TABLE_BASE + 8 * cpu` (the page at 0x0
+ * that `main()` reserves) and waiting with `wfe`. Core 0 writes the address of
+ * `secondary_entry` there and wakes them with `sev`. `secondary_entry` drops
+ * the core to EL1, installs the exception vector table, takes the slot of the
+ * core in `secondary_stacks` and loads the page tables core 0 built, then
+ * `secondary_main` makes the boot context the idle task of the core.
+ */
+char secondary_stacks[NR_CPUS - 1][SECONDARY_STACK_SIZE] __attribute__((aligned(16)));
+
+// Set by each core once it runs its idle task, a flag per core instead of a mask: no atomics needed
+static volatile int online[NR_CPUS] = { 1 };
+
+extern void secondary_entry(void);
+
+int cpu_online(int cpu) {
+    return online[cpu];
+}
+
+// Let the other cores wake this one through its mailbox 0
+void ipi_enable() {
+    *CORE_MBOX_IRQ_CTRL(cpu_id()) = 1;
+}
+
+// Bring a core out of `wfi`, see `idle_wait`
+void smp_send_wakeup(int cpu) {
+    *CORE_MBOX0_SET(cpu) = 1;
+}
+
+// Called on core 0 once the scheduler and the allocators are up, waits at most 100ms for the cores
+void smp_init() {
+    ipi_enable();
+    for (int cpu = 1; cpu < NR_CPUS; cpu++) {
+        volatile unsigned long *release = (volatile unsigned long *)(SPIN_TABLE_BASE + 8UL * cpu);
+        *release = (unsigned long)secondary_entry;
+        dcache_clean_invalidate_range((void *)release, sizeof(unsigned long));  // The parked core reads memory
+    }
+    asm volatile("sev");
+
+    int cnt = 1;
+    unsigned long long deadline = get_tick() + get_freq() / 10;
+    while (get_tick() < deadline) {
+        cnt = 0;
+        for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+            cnt += online[cpu];
+        }
+        if (cnt == NR_CPUS) break;
+    }
+
+    uart_puts("[SMP] ");
+    uart_puts(itoa(cnt));
+    uart_puts(" of ");
+    uart_puts(itoa(NR_CPUS));
+    uart_puts(" cores online\r\n");
+}
+
+// C entry of cores 1-3, on their boot stack with the MMU on
+void secondary_main() {
+    if (sched_init_secondary()) {
+        return;  // Back to `proc_hang`, core 0 reports the core as offline
+    }
+    secondary_timer_init();
+    ipi_enable();
+    online[cpu_id()] = 1;
+    enable_irq_el1();
+    idle();
+}
@@ -0,0 +1,166 @@
+#include "stack.h"
+
+/*
+ * Task stack pool.
+ *
+ * Every task takes a kernel and a user stack of one page, and short-lived
+ * tasks give them back soon after. Instead of going through a split and a
+ * merge in the buddy allocator each time, the stacks of reaped tasks are kept
+ * in a bounded LIFO pool and handed to the next tasks, still warm in the
+ * caches. Above `STACK_POOL_HIGH` the extra stacks go back in one
+ * `_free_bulk` call.
+ *
+ * With STACK_POISON, every stack handed out is filled with
+ * `STACK_POISON_WORD`. Stacks grow down, so when a stack comes back the
+ * poison left at its bottom tells how deep it was used.
+ */
+struct StackStats stack_stats;
+
+static void *stack_pool[STACK_POOL_HIGH];
+static int stack_pool_cnt = 0;
+static struct spinlock stack_pool_lock;  // The pool and `stack_stats`
+
+#ifdef STACK_POISON
+static void stack_poison(void *stack) {
+    uint64_t *word = stack;
+    for (int i = 0; i < THREAD_STACK_SIZE / 8; i++) {
+        word[i] = STACK_POISON_WORD;
+    }
+}
+
+// Bytes of the stack written since it was poisoned, the untouched poison is at the bottom
+static int stack_depth(void *stack) {
+    uint64_t *word = stack;
+    int untouched = 0;
+    while (untouched < THREAD_STACK_SIZE / 8 && word[untouched] == STACK_POISON_WORD) {
+        untouched++;
+    }
+    return THREAD_STACK_SIZE - untouched * 8;
+}
+#endif
+
+/**
+ * stack_alloc - Take stacks for a new task, recycled ones first
+ *
+ * Recycled stacks still hold the data of their previous task, callers that
+ * hand a stack to user space without overwriting it use `stack_alloc_clean`.
+ *
+ * @param stacks: Filled with `count` stacks of `THREAD_STACK_SIZE`
+ * @param count: Number of stacks, at most `MAX_BULK`
+ * @return 0 on success, -1 if there is not enough memory, nothing is taken then
+ */
+int stack_alloc(void **stacks, int count) {
+    int i = 0;
+    unsigned long flags = irq_save();
+    spin_lock(&stack_pool_lock);
+    while (i < count && stack_pool_cnt > 0) {
+        stacks[i++] = stack_pool[--stack_pool_cnt];
+    }
+    spin_unlock(&stack_pool_lock);
+    irq_restore(flags);
+
+    int failed = i < count && _alloc_bulk_class(0, ALLOC_TEMPORARY, count - i, stacks + i);
+
+    flags = irq_save();
+    spin_lock(&stack_pool_lock);
+    if (failed) {
+        // Put the pooled stacks back, the pool may have been refilled meanwhile
+        while (i > 0 && stack_pool_cnt < STACK_POOL_HIGH) {
+            stack_pool[stack_pool_cnt++] = stacks[--i];
+        }
+        spin_unlock(&stack_pool_lock);
+        irq_restore(flags);
+        _free_bulk(stacks, i);
+        return -1;
+    }
+    stack_stats.hit_cnt += i;
+    stack_stats.miss_cnt += count - i;
+    spin_unlock(&stack_pool_lock);
+    irq_restore(flags);
+
+#ifdef STACK_POISON
+    for (i = 0; i < count; i++) {
+        stack_poison(stacks[i]);
+    }
+#endif
+    return 0;
+}
+
+// A stack without data of a previous task: zeroed, or poisoned with STACK_POISON
+void* stack_alloc_clean() {
+#ifdef STACK_POISON
+    void *stack;
+    if (stack_alloc(&stack, 1)) return NULL;
+    return stack;
+#else
+    return _alloc_zeroed(THREAD_STACK_SIZE);
+#endif
+}
+
+/**
+ * stack_free - Give back the stacks of a reaped task
+ *
+ * The stacks go to the pool up to `STACK_POOL_HIGH`, the rest to the page
+ * allocator in a single `_free_bulk` call.
+ *
+ * @param stacks: Stacks from `stack_alloc` or `stack_alloc_clean`
+ * @param count: Number of stacks, at most `MAX_BULK`
+ */
+void stack_free(void **stacks, int count) {
+    void *extra[MAX_BULK];
+    int extra_cnt = 0;
+
+    unsigned long flags = irq_save();
+    spin_lock(&stack_pool_lock);
+    for (int i = 0; i < count; i++) {
+#ifdef STACK_POISON
+        int depth = stack_depth(stacks[i]);
+        if (depth > stack_stats.max_depth) {
+            stack_stats.max_depth = depth;
+            if (depth == THREAD_STACK_SIZE) {
+                uart_puts("[!] stack_free: a stack was used to its end, it may have overflowed!\r\n");
+            }
+        }
+#endif
+        if (stack_pool_cnt < STACK_POOL_HIGH) {
+            stack_pool[stack_pool_cnt++] = stacks[i];
+        }
+        else {
+            extra[extra_cnt++] = stacks[i];
+        }
+    }
+    stack_stats.release_cnt += extra_cnt;
+    spin_unlock(&stack_pool_lock);
+    irq_restore(flags);
+
+    if (extra_cnt > 0) {
+        _free_bulk(extra, extra_cnt);
+    }
+}
+
+// Give every pooled stack back to the page allocator, return the number of pages
+int stack_pool_drain() {
+    void *stacks[STACK_POOL_HIGH];
+    unsigned long flags = irq_save();
+    spin_lock(&stack_pool_lock);
+    int pages = stack_pool_cnt;
+    for (int i = 0; i < pages; i++) {
+        stacks[i] = stack_pool[i];
+    }
+    stack_pool_cnt = 0;
+    stack_stats.release_cnt += pages;
+    spin_unlock(&stack_pool_lock);
+    irq_restore(flags);
+
+    _free_bulk(stacks, pages);  // Outside the lock, the shrinkers run with the page allocator unlocked
+    return pages;
+}
+
+// The pooled stacks are the first memory to give back under pressure
+void stack_pool_init() {
+    register_shrinker("stack_pool", stack_pool_drain);
+}
+
+int stack_pool_count() {
+    return stack_pool_cnt;
+}
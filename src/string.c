@@ -1,4 +1,5 @@
 #include "string.h"
+#include "alloc_profile.h"
 
 int strcmp (const char *s1, const char *s2) {
     while (*s1 && *s2 && *s1 == *s2) {
@@ -40,6 +41,7 @@ char* strdup(const char *s) {
     unsigned int len = strlen(s);
     char *dup = (char*)alloc(len + 1);
     if (dup == NULL) return NULL;
+    alloc_profile_add(dup, len + 1, __builtin_return_address(0));  // Charge the caller, not strdup
     for (unsigned int i = 0; i < len; i++) {
         dup[i] = s[i];
     }
@@ -1,7 +1,5 @@
 #include "syscall.h"
 
-extern struct ThreadTask *ready_queue;
-extern unsigned int thread_cnt;
 
 void sys_getpid(struct TrapFrame *trapframe) {
     // uart_puts("sys_getpid called\r\n");
@@ -80,33 +78,20 @@ void sys_fork(struct TrapFrame *trapframe) {
     }
 
     // Fork a new thread
-    struct ThreadTask *child_thread = (struct ThreadTask *)alloc(sizeof(struct ThreadTask));
+    struct ThreadTask *child_thread = task_alloc(0);
     if (child_thread == NULL) {
         uart_puts("Failed to allocate memory for new task\r\n");
         trapframe->x[0] = -1;
         return;
     }
 
-    child_thread->id = thread_cnt++;
     child_thread->state = TASK_READY;
-    child_thread->counter = parent_thread->counter;
     child_thread->priority = parent_thread->priority;
+    // The parent shares its slice with the child, forking does not buy CPU time
+    child_thread->counter = (parent_thread->counter + 1) / 2;
+    parent_thread->counter -= child_thread->counter;
     child_thread->preempt_count = parent_thread->preempt_count;
-    child_thread->kernel_stack = alloc(THREAD_STACK_SIZE);
-    if (child_thread->kernel_stack == NULL) {
-        uart_puts("Failed to allocate memory for new task stack\r\n");
-        free(child_thread);
-        trapframe->x[0] = -1;
-        return;
-    }
-    child_thread->user_stack = alloc(THREAD_STACK_SIZE);
-    if (child_thread->user_stack == NULL) {
-        uart_puts("Failed to allocate memory for new task user stack\r\n");
-        free(child_thread->kernel_stack);
-        free(child_thread);
-        trapframe->x[0] = -1;
-        return;
-    }
+    child_thread->cpus_allowed = parent_thread->cpus_allowed;
 
     child_thread->pending_sig = parent_thread->pending_sig;
     for (int i = 0; i < SIG_NUM; i++) {
@@ -133,7 +118,7 @@ void sys_fork(struct TrapFrame *trapframe) {
     child_frame->sp_el0 = (unsigned long)(child_thread->user_stack + ((void*)trapframe->sp_el0 - parent_thread->user_stack));  // Set the stack pointer to the new task's stack
     child_thread->cpu_context.lr = &&SYSCALL_FORK_END;
 
-    add_thread_task(&ready_queue, child_thread);
+    sched_enqueue(child_thread);
 
     trapframe->x[0] = child_thread->id;  // return child_thread->id
 
@@ -210,7 +195,7 @@ void sys_sigkill(struct TrapFrame *trapframe) {
     int sig = (int)trapframe->x[1];
 
     struct ThreadTask *task = get_thread_task_by_id(pid);
-    if (task == NULL) {
+    if (task == NULL || task->state == TASK_EXITED) {
         uart_puts("[WARN] sys_sigkill: task not found\r\n");
         return;
     }
@@ -220,7 +205,7 @@ void sys_sigkill(struct TrapFrame *trapframe) {
         return;
     }
     
-    task->pending_sig |= (1 << sig);  // Set the pending signal
+    signal_raise(task, sig);  // The task may run on another core
 }
 
 void sys_sigreturn(struct TrapFrame *trapframe) {
@@ -235,7 +220,7 @@ void sys_sigreturn(struct TrapFrame *trapframe) {
     free(curr->cpu_context.fp - THREAD_STACK_SIZE);
 
     // Restore the trapframe
-    memcpy(trapframe, &curr->sig_frame, sizeof(struct TrapFrame));
+    memcpy(trapframe, curr->sig_frame, sizeof(struct TrapFrame));
     return;
 }
 
@@ -10,8 +10,27 @@ struct Timer {
     unsigned long long expiration;  // Unit: tick
 };
 
+/*
+ * The timer list and the physical timer of core 0 that fires for its head.
+ * Any core may add a timer, only core 0 runs them. IRQs stay masked while
+ * `timer_lock` is held, the callbacks run without it since they add timers.
+ */
 static struct Timer* timer_head = NULL;
+static struct spinlock timer_lock;
+static struct kmem_cache* timer_cache = NULL;
 static int need_schedule = 0;
+static int balance_ticks = 0;
+
+static unsigned long timer_lock_irqsave() {
+    unsigned long flags = irq_save();
+    spin_lock(&timer_lock);
+    return flags;
+}
+
+static void timer_unlock_irqrestore(unsigned long flags) {
+    spin_unlock(&timer_lock);
+    irq_restore(flags);
+}
 
 void timer_enable_irq() {
     // uart_puts("Enabling timer IRQ @");
@@ -19,7 +38,7 @@ void timer_enable_irq() {
     // uart_puts("\r\n");
 
     asm volatile("msr cntp_ctl_el0, %0"::"r"(1));
-    *CORE0_TIMER_IRQ_CTRL = (1 << 1);
+    *CORE_TIMER_IRQ_CTRL(cpu_id()) = (1 << 1);
 }
 
 void timer_disable_irq() {
@@ -28,7 +47,7 @@ void timer_disable_irq() {
     // uart_puts("\r\n");
 
     asm volatile("msr cntp_ctl_el0, %0"::"r"(0));
-    *CORE0_TIMER_IRQ_CTRL &= ~(1 << 1);
+    *CORE_TIMER_IRQ_CTRL(cpu_id()) &= ~(1 << 1);
 }
 
 void set_timer_irq(unsigned long long tick) {
@@ -36,6 +55,24 @@ void set_timer_irq(unsigned long long tick) {
     asm volatile("msr cntp_tval_el0, %0"::"r"(expiration));
 }
 
+// Program the timer of core 0 for the head of the list, with `timer_lock` held on core 0
+static void timer_program_locked() {
+    if (timer_head == NULL) {
+        timer_disable_irq();
+        return;
+    }
+    unsigned long long curr_tick = get_tick();
+    set_timer_irq(timer_head->expiration > curr_tick ? timer_head->expiration - curr_tick : 0);
+    timer_enable_irq();
+}
+
+// Called on core 0 for a wake-up in its mailbox: another core may have added a timer at the head of the list
+void timer_rearm() {
+    unsigned long flags = timer_lock_irqsave();
+    timer_program_locked();
+    timer_unlock_irqrestore(flags);
+}
+
 void print_msg(char* msg) {
     unsigned long long curr_tick = get_tick();
     unsigned long long freq = get_freq();
@@ -58,23 +95,85 @@ void print_uptime(char* _) {
     add_timer(print_uptime, NULL, 2 * freq);
 }
 
+// Scheduler tick, switches the task out when its time slice is used up and balances the cores now and then
 void keep_schedule(char* _) {
-    add_timer(keep_schedule, NULL, get_freq() >> 8);
-    need_schedule = 1;
+    add_timer(keep_schedule, NULL, get_freq() >> SCHED_TICK_SHIFT);
+    if (++balance_ticks >= BALANCE_INTERVAL) {
+        balance_ticks = 0;
+        sched_balance();
+    }
+    if (sched_tick()) need_schedule = 1;
 }
 
-void timer_init() {
-    timer_enable_irq();
-
+// Let EL0 read the counter of this core, `cntkctl_el1` is banked per core
+static void enable_el0_counter() {
     unsigned long tmp;
     asm volatile("mrs %0, cntkctl_el1" : "=r"(tmp));
     tmp |= 1;
     asm volatile("msr cntkctl_el1, %0" : : "r"(tmp));
+}
+
+void timer_init() {
+    timer_cache = kmem_cache_create("timer", sizeof(struct Timer), 0, NULL);
+    timer_enable_irq();
+    enable_el0_counter();
 
     add_timer(keep_schedule, NULL, get_freq() >> 5);
 }
 
+/*
+ * The timer list lives on core 0. The secondary cores only need the scheduler
+ * tick, their own physical timer is rearmed for it at every interrupt.
+ */
+void secondary_timer_init() {
+    enable_el0_counter();
+    set_timer_irq(get_freq() >> SCHED_TICK_SHIFT);
+    timer_enable_irq();
+}
+
+void secondary_timer_handler() {
+    set_timer_irq(get_freq() >> SCHED_TICK_SHIFT);
+    if (sched_tick()) schedule();
+}
+
+/*
+ * Tickless idle: `tick_stop` and `tick_restart` bracket the `wfi` of an idle
+ * core, with IRQs masked. A secondary core turns its timer off. Core 0 takes
+ * `keep_schedule` out of the timer list and programs the timer for the head
+ * of the list, if any, so that it only wakes up for a timer that is due.
+ */
+void tick_stop() {
+    if (cpu_id() != 0) {
+        timer_disable_irq();
+        return;
+    }
+
+    unsigned long flags = timer_lock_irqsave();
+    struct Timer* curr = timer_head;
+    while (curr != NULL && curr->callback != keep_schedule) {
+        curr = curr->next;
+    }
+    if (curr != NULL) {
+        if (curr->prev) curr->prev->next = curr->next;
+        else timer_head = curr->next;
+        if (curr->next) curr->next->prev = curr->prev;
+        kmem_cache_free(timer_cache, curr);
+    }
+    timer_program_locked();
+    timer_unlock_irqrestore(flags);
+}
+
+void tick_restart() {
+    if (cpu_id() != 0) {
+        set_timer_irq(get_freq() >> SCHED_TICK_SHIFT);
+        timer_enable_irq();
+        return;
+    }
+    add_timer(keep_schedule, NULL, get_freq() >> SCHED_TICK_SHIFT);
+}
+
 void print_timer_list() {
+    unsigned long flags = timer_lock_irqsave();
     struct Timer* curr = timer_head;
     uart_puts("Timer list:\r\n");
     while (curr != NULL) {
@@ -85,6 +184,7 @@ void print_timer_list() {
         uart_puts("\r\n");
         curr = curr->next;
     }
+    timer_unlock_irqrestore(flags);
 }
 
 void core_timer_handler() {
@@ -97,27 +197,27 @@ void core_timer_handler() {
     timer_disable_irq();
     enable_irq_el1();  // Can enable IRQ in advance for other interrupts
 
-    // Clear all expired timers
-    int removed = 0;
-
-    while (timer_head != NULL && timer_head->expiration <= curr_tick) {
+    // Clear all expired timers, one at a time out of the list
+    while (1) {
+        unsigned long flags = timer_lock_irqsave();
         struct Timer* curr = timer_head;
+        if (curr == NULL || curr->expiration > curr_tick) {
+            timer_unlock_irqrestore(flags);
+            break;
+        }
         timer_head = curr->next;
         if (curr->next) curr->next->prev = NULL;
-        removed = 1;
+        timer_unlock_irqrestore(flags);
 
         curr->callback(curr->msg);
-        free(curr);
+        kmem_cache_free(timer_cache, curr);
     }
 
-    // Reset the timer
-    if (removed && timer_head) {
-        set_timer_irq(timer_head->expiration - curr_tick);
-        timer_enable_irq();
-    }
-    else {
-        uart_puts("No timer to reset\r\n");
-    }
+    // Reset the timer, for a head another core may have added meanwhile too
+    unsigned long flags = timer_lock_irqsave();
+    if (timer_head == NULL) uart_puts("No timer to reset\r\n");
+    timer_program_locked();
+    timer_unlock_irqrestore(flags);
 
     if (need_schedule) {
         need_schedule = 0;
@@ -153,22 +253,25 @@ void set_timeout(char* msg, int sec) {
 }
 
 void add_timer(timer_callback callback, char* msg, unsigned long long tick) {
-    struct Timer* new_timer = (struct Timer*)alloc(sizeof(struct Timer));
+    struct Timer* new_timer = (struct Timer*)kmem_cache_alloc(timer_cache);
     if (new_timer == NULL) {
         uart_puts("Failed to allocate memory for timer\r\n");
         return;
     }
 
     unsigned long long curr_tick = get_tick();
-    memcpy(new_timer->msg, msg, strlen(msg) + 1);
+    if (msg != NULL) memcpy(new_timer->msg, msg, strlen(msg) + 1);
+    else new_timer->msg[0] = '\0';  // keep_schedule passes NULL, it would read the spin table at 0x0
     new_timer->expiration = curr_tick + tick;
     new_timer->callback = callback;
     
 
     int reset = 0;
+    int core0 = cpu_id() == 0;
 
     // Add the new timer to the list
-    timer_disable_irq();
+    unsigned long flags = timer_lock_irqsave();
+    if (core0) timer_disable_irq();
     if (timer_head == NULL) {  // List is empty
         new_timer->prev = NULL;
         new_timer->next = NULL;
@@ -189,15 +292,17 @@ void add_timer(timer_callback callback, char* msg, unsigned long long tick) {
         }
         new_timer->next = curr->next;
         new_timer->prev = curr;
-        curr->next = new_timer;
-        if (curr->next != NULL) {
+        if (curr->next != NULL) {  // `tick_stop` unlinks through `prev`
             curr->next->prev = new_timer;
         }
+        curr->next = new_timer;
     }
 
-    // Reset the timer
-    if (reset) {
-        set_timer_irq(timer_head->expiration - curr_tick);
+    // Reset the timer. The timer of another core ticks its scheduler, core 0 rearms its own once woken up
+    if (core0) {
+        if (reset) set_timer_irq(timer_head->expiration - curr_tick);
+        timer_enable_irq();
     }
-    timer_enable_irq();
+    timer_unlock_irqrestore(flags);
+    if (reset && !core0) smp_send_wakeup(0);
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "uart.h"
+#include "smp.h"
 
 #define BUFFER_SIZE 4096
 
@@ -9,6 +10,9 @@ unsigned long rx_buffer_tail = 0;        // The index of the next character to b
 unsigned long tx_buffer_head = 0;
 unsigned long tx_buffer_tail = 0;
 
+// The mini UART registers and the ring buffers, shared by every core and the UART IRQ of core 0
+static struct spinlock uart_lock;
+
 
 void delay(unsigned int cycles) {
     volatile unsigned int i;
@@ -81,11 +85,21 @@ void uart_flush_tx() {
 }
 
 
+// The lock is only held to take a character, a core waiting for input does not block the others
 char uart_getc() {
-    char ch;
-    do { asm volatile("nop"); } while (!(*AUX_MU_LSR_REG & 0x1));
-    ch = (char)(*AUX_MU_IO_REG);
-    return ch;
+    while (1) {
+        unsigned long flags = irq_save();
+        spin_lock(&uart_lock);
+        if (*AUX_MU_LSR_REG & 0x1) {
+            char ch = (char)(*AUX_MU_IO_REG);
+            spin_unlock(&uart_lock);
+            irq_restore(flags);
+            return ch;
+        }
+        spin_unlock(&uart_lock);
+        irq_restore(flags);
+        asm volatile("nop");
+    }
 }
 
 
@@ -117,9 +131,14 @@ int *uart_getn(char *buffer, unsigned int n) {
 }
 
 
+// Another core could fill the FIFO between the check and the write
 void uart_putc(char ch) {
+    unsigned long flags = irq_save();
+    spin_lock(&uart_lock);
     do { asm volatile("nop"); } while (!(*AUX_MU_LSR_REG & 0x20));
     *AUX_MU_IO_REG = (unsigned int)ch;
+    spin_unlock(&uart_lock);
+    irq_restore(flags);
 }
 
 
@@ -222,6 +241,8 @@ void uart_irq_handler() {
  * the RX FIFO and store it in the RX buffer (`rx_buffer`).
  */
 void uart_irq_rx_handler() {
+    unsigned long flags = irq_save();
+    spin_lock(&uart_lock);
 
     // Check if the buffer is full
     if ((rx_buffer_head + 1) % BUFFER_SIZE == rx_buffer_tail) {
@@ -231,6 +252,8 @@ void uart_irq_rx_handler() {
         rx_buffer[rx_buffer_head] = (char)(*AUX_MU_IO_REG);
         rx_buffer_head = (rx_buffer_head + 1) % BUFFER_SIZE;
     }
+    spin_unlock(&uart_lock);
+    irq_restore(flags);
 }
 
 
@@ -242,6 +265,9 @@ void uart_irq_rx_handler() {
  * TX buffer (`tx_buffer`) to the TX FIFO.
  */
 void uart_irq_tx_handler() {
+    unsigned long flags = irq_save();
+    spin_lock(&uart_lock);
+
     // Check if the buffer is empty
     if (tx_buffer_head == tx_buffer_tail) {
         uart_disable_tx_irq();
@@ -250,6 +276,8 @@ void uart_irq_tx_handler() {
         *AUX_MU_IO_REG = tx_buffer[tx_buffer_tail];
         tx_buffer_tail = (tx_buffer_tail + 1) % BUFFER_SIZE;
     }
+    spin_unlock(&uart_lock);
+    irq_restore(flags);
 }
 
 
@@ -259,15 +287,22 @@ void uart_irq_tx_handler() {
  * @return: 1 if a character was received, 0 if no character was available
  */
 int uart_async_getc(char *ch) {
+    unsigned long flags = irq_save();
+    spin_lock(&uart_lock);
+    int got = 0;
+
     // Check if the buffer is empty
     if (rx_buffer_head == rx_buffer_tail) {
         *AUX_MU_IER_REG |= 0x01;  // Enable RX interrupt
-        return 0;
     }
-
-    *ch = rx_buffer[rx_buffer_tail];
-    rx_buffer_tail = (rx_buffer_tail + 1) % BUFFER_SIZE;
-    return 1;
+    else {
+        *ch = rx_buffer[rx_buffer_tail];
+        rx_buffer_tail = (rx_buffer_tail + 1) % BUFFER_SIZE;
+        got = 1;
+    }
+    spin_unlock(&uart_lock);
+    irq_restore(flags);
+    return got;
 }
 
 
@@ -277,9 +312,14 @@ int uart_async_getc(char *ch) {
  * @return: 1 if a character was added to the buffer, 0 if the buffer is full
  */
 int uart_async_putc(char ch) {
+    unsigned long flags = irq_save();
+    spin_lock(&uart_lock);
+
     // Check if the buffer is full
     if ((tx_buffer_head + 1) % BUFFER_SIZE == tx_buffer_tail) {
         uart_enable_tx_irq();  // Buffer is full, enable TX interrupt
+        spin_unlock(&uart_lock);
+        irq_restore(flags);
         return 0;
     }
 
@@ -294,6 +334,8 @@ int uart_async_putc(char ch) {
         tx_buffer_head = (tx_buffer_head + 1) % BUFFER_SIZE;
     }
     uart_enable_tx_irq();  // Have data to send, enable TX interrupt
+    spin_unlock(&uart_lock);
+    irq_restore(flags);
     return 1;
 }
 
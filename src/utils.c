@@ -96,6 +96,16 @@ uint32_t be2le_u32(uint32_t be) {
     return ((be & 0xFF) << 24) | ((be & 0xFF00) << 8) | ((be & 0xFF0000) >> 8) | ((be & 0xFF000000) >> 24);
 }
 
+/**
+ * be2le_u64 - Converts a big-endian 64-bit unsigned integer to little-endian
+ * 
+ * @param be The big-endian 64-bit unsigned integer
+ * @return The little-endian 64-bit unsigned integer
+ */
+uint64_t be2le_u64(uint64_t be) {
+    return ((uint64_t)be2le_u32((uint32_t)be) << 32) | be2le_u32((uint32_t)(be >> 32));
+}
+
 unsigned int align(unsigned int n, unsigned int alignment) {
     return (n + alignment - 1) & ~(alignment - 1);
 }
\ No newline at end of file